@@ -0,0 +1,81 @@
+// MAP_HUGETLB, MADV_HUGEPAGE
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+#define MAP_HUGE_2MB_PAGES (21 << MAP_HUGE_SHIFT)
+
+void arena_init(struct arena *a, size_t size) {
+	memset(a, 0, sizeof(struct arena));
+	a->size = size;
+	pthread_mutex_init(&a->lock, NULL);
+}
+
+//Map a chunk that is one huge page, or NULL.
+static char *map_chunk(struct arena *a) {
+	void *p;
+	if (!a->no_hugetlb) {
+		p = mmap(NULL, ARENA_CHUNK, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB_PAGES, -1, 0);
+		if (p != MAP_FAILED) {
+			a->hugetlb_chunks++;
+			return p;
+		}
+		a->no_hugetlb = true;
+	}
+
+	//Transparent huge pages need the chunk on a 2 MiB boundary: map twice
+	//as much and trim both ends.
+	p = mmap(NULL, 2 * ARENA_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		return NULL;
+	}
+	uintptr_t base = (uintptr_t) p;
+	uintptr_t start = (base + ARENA_CHUNK - 1) & ~(uintptr_t) (ARENA_CHUNK - 1);
+	if (start > base) {
+		munmap(p, start - base);
+	}
+	munmap((void *) (start + ARENA_CHUNK), base + ARENA_CHUNK - start);
+	madvise((void *) start, ARENA_CHUNK, MADV_HUGEPAGE);
+	return (char *) start;
+}
+
+void *arena_get(struct arena *a) {
+	void *obj;
+	pthread_mutex_lock(&a->lock);
+	if (a->free) {
+		obj = a->free;
+		a->free = *(void **) obj;
+	} else {
+		if (a->bump == a->bump_end) {
+			char *chunk = map_chunk(a);
+			if (chunk == NULL) {
+				pthread_mutex_unlock(&a->lock);
+				return NULL;
+			}
+			a->bump = chunk;
+			a->bump_end = chunk + ARENA_CHUNK;
+			a->chunks++;
+		}
+		obj = a->bump;
+		a->bump += a->size;
+	}
+	a->in_use++;
+	pthread_mutex_unlock(&a->lock);
+	return obj;
+}
+
+void arena_put(struct arena *a, void *obj) {
+	if (obj == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&a->lock);
+	*(void **) obj = a->free;
+	a->free = obj;
+	a->in_use--;
+	pthread_mutex_unlock(&a->lock);
+}
@@ -0,0 +1,43 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Fixed-size buffers in 2 MiB huge pages.
+//
+// With a large working set spread over 4 KiB pages, nearly every block a
+// read or write copies misses the TLB. An arena carves its buffers from
+// chunks of ARENA_CHUNK bytes that are each one huge page: from the hugetlb
+// pool when the system has pages reserved there (MAP_HUGETLB), otherwise
+// aligned anonymous memory that the kernel is asked to back with
+// transparent huge pages. Chunks are never returned to the system, and
+// freed buffers are handed out again newest first.
+
+#define ARENA_CHUNK (2 * 1024 * 1024)
+
+struct arena {
+	size_t size;
+	pthread_mutex_t lock;
+	// free list, linked through the first word of each buffer
+	void *free;
+	// unused tail of the newest chunk
+	char *bump;
+	char *bump_end;
+	size_t chunks;
+	// chunks from the hugetlb pool, the rest rely on transparent huge pages
+	size_t hugetlb_chunks;
+	// the hugetlb pool ran dry once, it is not asked again
+	bool no_hugetlb;
+	size_t in_use;
+};
+
+// size must divide ARENA_CHUNK.
+void arena_init(struct arena *a, size_t size);
+
+// A buffer of the arena's size, or NULL if no chunk could be mapped.
+void *arena_get(struct arena *a);
+void arena_put(struct arena *a, void *obj);
+
+#endif
@@ -0,0 +1,228 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "benchfill.h"
+#include "core.h"
+#include "stats.h"
+
+// Microbenchmarks of the filesystem core, called directly without a mount.
+//
+//     ./lfs-bench [-n files] [-s data MiB] [-b block size] [-r readdir batch]
+//
+// Prints one line per phase: ops, ops per second and latency percentiles.
+
+static int nfiles = 10000;
+static size_t data_size = 64 << 20;
+static size_t block_size = 4096;
+static int readdir_batch = 128;
+
+// Latencies of the current phase.
+static uint64_t *lat;
+static size_t nlat;
+static size_t lat_cap;
+static uint64_t phase_start;
+
+static void begin(void) {
+	nlat = 0;
+	phase_start = stats_now();
+}
+
+static void record(uint64_t start) {
+	if (nlat == lat_cap) {
+		lat_cap = lat_cap ? lat_cap * 2 : 4096;
+		lat = realloc(lat, lat_cap * sizeof(uint64_t));
+		if (lat == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	lat[nlat++] = stats_now() - start;
+}
+
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static double pct(double q) {
+	size_t i = q * nlat;
+	return lat[i < nlat ? i : nlat - 1] / 1000.0;
+}
+
+static void end(const char *phase) {
+	double secs = (stats_now() - phase_start) / 1e9;
+	if (nlat == 0) {
+		return;
+	}
+	qsort(lat, nlat, sizeof(uint64_t), compare_u64);
+	printf("%-10s %10zu %12.0f %10.2f %10.2f %10.2f %10.2f %10.2f\n", phase, nlat, nlat / secs,
+		pct(0.5), pct(0.9), pct(0.99), pct(0.999), lat[nlat - 1] / 1000.0);
+}
+
+static void check(int res, const char *what) {
+	if (res < 0) {
+		fprintf(stderr, "%s: %s\n", what, strerror(-res));
+		exit(1);
+	}
+}
+
+// A readdir reply with room for left more names.
+struct reply {
+	int left;
+	off_t last;
+};
+
+static int count_filler(void *buf, const char *name, const struct stat *st, off_t off, enum fuse_fill_dir_flags flags) {
+	struct reply *reply = buf;
+	if (reply->left == 0) {
+		return 1;
+	}
+	reply->left--;
+	reply->last = off;
+	return 0;
+}
+
+static void bench_meta(void) {
+	char path[64];
+	struct stat st;
+
+	check(lfs_mkdir("/bench", 0755), "mkdir");
+
+	begin();
+	for (int i = 0; i < nfiles; i++) {
+		snprintf(path, sizeof(path), "/bench/f%d", i);
+		uint64_t start = stats_now();
+		check(lfs_mknod(path, 0644, 0), "create");
+		record(start);
+	}
+	end("create");
+
+	begin();
+	for (int i = 0; i < nfiles; i++) {
+		snprintf(path, sizeof(path), "/bench/f%d", rand() % nfiles);
+		uint64_t start = stats_now();
+		check(get_entry(path), "lookup");
+		record(start);
+	}
+	end("lookup");
+
+	begin();
+	for (int i = 0; i < nfiles; i++) {
+		snprintf(path, sizeof(path), "/bench/f%d", rand() % nfiles);
+		uint64_t start = stats_now();
+		check(lfs_getattr(path, &st, NULL), "getattr");
+		record(start);
+	}
+	end("getattr");
+
+	//One op is one reply of readdir_batch names, the way the kernel pages a
+	//listing.
+	begin();
+	for (int pass = 0; pass < 10; pass++) {
+		struct reply reply = { 0 };
+		off_t offset = 0;
+		do {
+			reply.left = readdir_batch;
+			uint64_t start = stats_now();
+			check(lfs_readdir("/bench", &reply, count_filler, offset, NULL, FUSE_READDIR_PLUS), "readdir");
+			record(start);
+			offset = reply.last;
+		} while (reply.left == 0);
+	}
+	end("readdir");
+}
+
+static void bench_data(void) {
+	struct fuse_file_info fi;
+	size_t blocks = data_size / block_size;
+	char *buf = malloc(block_size);
+
+	check(lfs_mknod("/data", 0644, 0), "create");
+	memset(&fi, 0, sizeof(fi));
+	check(lfs_open("/data", &fi), "open");
+
+	begin();
+	for (size_t i = 0; i < blocks; i++) {
+		bench_fill(buf, block_size, i);
+		uint64_t start = stats_now();
+		check(lfs_write("/data", buf, block_size, i * block_size, &fi), "write");
+		record(start);
+	}
+	end("seqwrite");
+
+	begin();
+	for (size_t i = 0; i < blocks; i++) {
+		uint64_t start = stats_now();
+		check(lfs_read("/data", buf, block_size, i * block_size, &fi), "read");
+		record(start);
+	}
+	end("seqread");
+
+	begin();
+	for (size_t i = 0; i < blocks; i++) {
+		off_t offset = (rand() % blocks) * block_size;
+		bench_fill(buf, block_size, blocks + i);
+		uint64_t start = stats_now();
+		check(lfs_write("/data", buf, block_size, offset, &fi), "write");
+		record(start);
+	}
+	end("randwrite");
+
+	begin();
+	for (size_t i = 0; i < blocks; i++) {
+		off_t offset = (rand() % blocks) * block_size;
+		uint64_t start = stats_now();
+		check(lfs_read("/data", buf, block_size, offset, &fi), "read");
+		record(start);
+	}
+	end("randread");
+
+	lfs_release("/data", &fi);
+	free(buf);
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	bool hugepages = false;
+	while ((opt = getopt(argc, argv, "n:s:b:r:H")) != -1) {
+		switch (opt) {
+		case 'n':
+			nfiles = atoi(optarg);
+			break;
+		case 's':
+			data_size = (size_t) atoi(optarg) << 20;
+			break;
+		case 'b':
+			block_size = atoi(optarg);
+			break;
+		case 'r':
+			readdir_batch = atoi(optarg);
+			break;
+		case 'H':
+			hugepages = true;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n files] [-s data MiB] [-b block size] [-r readdir batch] [-H]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (nfiles <= 0 || block_size == 0 || data_size < block_size || readdir_batch <= 0) {
+		fprintf(stderr, "%s: bad arguments\n", argv[0]);
+		return 1;
+	}
+
+	srand(1);
+	check(core_init(), "init");
+	if (hugepages) {
+		block_use_hugepages();
+	}
+	printf("%-10s %10s %12s %10s %10s %10s %10s %10s\n", "phase", "ops", "ops/s",
+		"p50_us", "p90_us", "p99_us", "p999_us", "max_us");
+	bench_meta();
+	bench_data();
+	return 0;
+}
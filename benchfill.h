@@ -0,0 +1,25 @@
+#ifndef BENCHFILL_H
+#define BENCHFILL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Data for the benchmarks to write. Blocks filled with one byte are all
+// deduplicated into one and compress to nothing, which lfs would measure
+// and a plain filesystem would not, so every block written gets bytes of
+// its own instead.
+
+// Fill buf with bytes that depend on n, so that no two blocks written with
+// a different n are deduplicated into one.
+static inline void bench_fill(char *buf, size_t size, uint64_t n) {
+	uint64_t x = n * 0x9e3779b97f4a7c15 + 1;
+	for (size_t i = 0; i < size; i += sizeof(x)) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		memcpy(buf + i, &x, size - i < sizeof(x) ? size - i : sizeof(x));
+	}
+}
+
+#endif
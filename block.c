@@ -0,0 +1,444 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "block.h"
+#include "log.h"
+#include "lz.h"
+#include "pool.h"
+#include "stats.h"
+
+// The index starts with this many buckets and doubles when it holds more
+// blocks than buckets.
+#define INITIAL_BUCKETS 1024
+
+// Compressed blocks must fit in this much.
+#define ZLEN_MAX (BLOCK_SIZE * 3 / 4)
+
+static struct pool data_pool;
+static struct pool block_pool;
+
+// Where block data comes from instead of data_pool, see block_use_hugepages.
+static struct arena data_arena;
+static bool use_arena;
+
+static struct block **buckets;
+static size_t nbuckets;
+
+static struct block_stats counts;
+
+// The image evicted blocks are read back from and the save that wrote it.
+// Reads bring blocks back side by side, so this lock covers that and the
+// locations of blocks, which a save running at the same time changes.
+static pthread_mutex_t image_lock = PTHREAD_MUTEX_INITIALIZER;
+static int image_fd = -1;
+static uint32_t image_saved;
+
+void block_init(void) {
+	if (data_pool.name == NULL) {
+		pool_init(&data_pool, "block", BLOCK_SIZE);
+		pool_init(&block_pool, "blockref", sizeof(struct block));
+	}
+}
+
+void block_use_hugepages(void) {
+	arena_init(&data_arena, BLOCK_SIZE);
+	use_arena = true;
+}
+
+static void *data_get(void) {
+	return use_arena ? arena_get(&data_arena) : pool_get(&data_pool);
+}
+
+static void data_put(void *data) {
+	if (use_arena) {
+		arena_put(&data_arena, data);
+	} else {
+		pool_put(&data_pool, data);
+	}
+}
+
+static inline uint64_t rotl(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+//Four independent multiply-rotate lanes over 8 byte words, so the hash of
+//a block runs at memory speed. Collisions are caught by comparing the data.
+static uint64_t hash_block(const char *data) {
+	const uint64_t p1 = 0x9e3779b185ebca87ULL, p2 = 0xc2b2ae3d27d4eb4fULL;
+	uint64_t h[4] = { p1, p2, ~p1, ~p2 };
+	for (size_t i = 0; i < BLOCK_SIZE; i += 32) {
+		for (int l = 0; l < 4; l++) {
+			uint64_t w;
+			memcpy(&w, data + i + l * 8, 8);
+			h[l] = rotl(h[l] + w * p2, 31) * p1;
+		}
+	}
+	uint64_t x = rotl(h[0], 1) + rotl(h[1], 7) + rotl(h[2], 12) + rotl(h[3], 18);
+	x ^= x >> 33;
+	x *= p2;
+	x ^= x >> 29;
+	return x;
+}
+
+struct block *block_new(void) {
+	struct block *b = pool_get(&block_pool);
+	if (b == NULL) {
+		return NULL;
+	}
+	b->data = data_get();
+	if (b->data == NULL) {
+		pool_put(&block_pool, b);
+		return NULL;
+	}
+	memset(b->data, 0, BLOCK_SIZE);
+	b->next = NULL;
+	b->refs = 1;
+	b->zlen = 0;
+	b->indexed = false;
+	b->incompressible = false;
+	b->hot_pass = 0;
+	b->image_gen = 0;
+	b->disk_gen = 0;
+	b->referenced = false;
+	__atomic_add_fetch(&counts.blocks, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&counts.refs, 1, __ATOMIC_RELAXED);
+	return b;
+}
+
+void block_get(struct block *b) {
+	b->refs++;
+	__atomic_add_fetch(&counts.refs, 1, __ATOMIC_RELAXED);
+}
+
+static void unindex(struct block *b) {
+	struct block **p = &buckets[b->hash & (nbuckets - 1)];
+	while (*p != b) {
+		p = &(*p)->next;
+	}
+	*p = b->next;
+	b->indexed = false;
+	__atomic_sub_fetch(&counts.indexed, 1, __ATOMIC_RELAXED);
+}
+
+void block_put(struct block *b) {
+	if (b == NULL) {
+		return;
+	}
+	__atomic_sub_fetch(&counts.refs, 1, __ATOMIC_RELAXED);
+	if (--b->refs > 0) {
+		return;
+	}
+	if (b->indexed) {
+		unindex(b);
+	}
+	if (b->data == NULL) {
+		__atomic_sub_fetch(&counts.evicted, 1, __ATOMIC_RELAXED);
+	} else if (b->zlen) {
+		free(b->data);
+		__atomic_sub_fetch(&counts.compressed, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&counts.compressed_bytes, b->zlen, __ATOMIC_RELAXED);
+	} else {
+		data_put(b->data);
+	}
+	pool_put(&block_pool, b);
+	__atomic_sub_fetch(&counts.blocks, 1, __ATOMIC_RELAXED);
+}
+
+//Where b is in the image on disk. Call with image_lock held.
+static bool image_location(struct block *b, uint64_t *offset) {
+	if (image_saved == 0) {
+		return false;
+	}
+	if (b->image_gen == image_saved) {
+		*offset = b->image_offset;
+		return true;
+	}
+	if (b->disk_gen == image_saved) {
+		*offset = b->disk_offset;
+		return true;
+	}
+	return false;
+}
+
+//Read an evicted block into scratch, or with keep into new data for it.
+static const char *load(struct block *b, char *scratch, bool keep) {
+	char buf[sizeof(uint16_t) + BLOCK_SIZE];
+	pthread_mutex_lock(&image_lock);
+	//Another read may have brought it back while this one waited.
+	char *data = __atomic_load_n(&b->data, __ATOMIC_ACQUIRE);
+	if (data) {
+		pthread_mutex_unlock(&image_lock);
+		return data;
+	}
+
+	uint64_t offset;
+	ssize_t n = -1;
+	uint16_t len = 0;
+	if (image_location(b, &offset)) {
+		n = pread(image_fd, buf, sizeof(buf), offset);
+	}
+	if (n >= (ssize_t) sizeof(uint16_t)) {
+		memcpy(&len, buf, sizeof(uint16_t));
+	}
+	if (n < (ssize_t) sizeof(uint16_t) || len > BLOCK_SIZE || n < (ssize_t) (sizeof(uint16_t) + len)) {
+		pthread_mutex_unlock(&image_lock);
+		lfs_log(LOG_ERROR, LOG_PERSIST, "could not read evicted block", NULL, b->image_gen, n);
+		return NULL;
+	}
+	data = keep ? data_get() : NULL;
+	char *dst = data ? data : scratch;
+	if (dst == NULL) {
+		pthread_mutex_unlock(&image_lock);
+		return NULL;
+	}
+	memcpy(dst, buf + sizeof(uint16_t), len);
+	memset(dst + len, 0, BLOCK_SIZE - len);
+	if (data) {
+		__atomic_store_n(&b->data, data, __ATOMIC_RELEASE);
+		__atomic_sub_fetch(&counts.evicted, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&image_lock);
+	return dst;
+}
+
+//Reads of one block can run side by side, each expands into its own scratch.
+const char *block_read(struct block *b, char *scratch) {
+	char *data = __atomic_load_n(&b->data, __ATOMIC_ACQUIRE);
+	if (data == NULL) {
+		return load(b, scratch, true);
+	}
+	if (b->zlen == 0) {
+		return data;
+	}
+	uint64_t start = stats_now();
+	lz_decompress(b->data, b->zlen, scratch, BLOCK_SIZE);
+	stats_record(STAT_DECOMPRESS, start, BLOCK_SIZE);
+	return scratch;
+}
+
+const char *block_peek(struct block *b, char *scratch) {
+	if (__atomic_load_n(&b->data, __ATOMIC_ACQUIRE) == NULL) {
+		return load(b, scratch, false);
+	}
+	return block_read(b, scratch);
+}
+
+bool block_compress(struct block *b) {
+	char buf[ZLEN_MAX];
+	if (b->zlen || b->incompressible || b->data == NULL) {
+		return b->zlen != 0;
+	}
+	uint64_t start = stats_now();
+	size_t zlen = lz_compress(b->data, BLOCK_SIZE, buf, sizeof(buf));
+	stats_record(STAT_COMPRESS, start, BLOCK_SIZE);
+	char *data = zlen ? malloc(zlen) : NULL;
+	if (data == NULL) {
+		b->incompressible = zlen == 0;
+		return false;
+	}
+	memcpy(data, buf, zlen);
+	data_put(b->data);
+	b->data = data;
+	b->zlen = zlen;
+	__atomic_add_fetch(&counts.compressed, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&counts.compressed_bytes, zlen, __ATOMIC_RELAXED);
+	return true;
+}
+
+int block_expand(struct block *b) {
+	if (b->zlen == 0) {
+		return 0;
+	}
+	char *data = data_get();
+	if (data == NULL) {
+		return -ENOMEM;
+	}
+	block_read(b, data);
+	free(b->data);
+	__atomic_sub_fetch(&counts.compressed, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&counts.compressed_bytes, b->zlen, __ATOMIC_RELAXED);
+	b->data = data;
+	b->zlen = 0;
+	return 0;
+}
+
+struct block *block_writable(struct block **slot) {
+	struct block *b = *slot;
+	if (b->refs == 1) {
+		if ((b->data == NULL && block_read(b, NULL) == NULL) || block_expand(b) != 0) {
+			return NULL;
+		}
+		if (b->indexed) {
+			unindex(b);
+		}
+		b->incompressible = false;
+		//The copy in the image is out of date now.
+		b->image_gen = 0;
+		b->disk_gen = 0;
+		return b;
+	}
+	struct block *copy = block_new();
+	if (copy == NULL) {
+		return NULL;
+	}
+	const char *data = block_peek(b, copy->data);
+	if (data == NULL) {
+		block_put(copy);
+		return NULL;
+	}
+	if (data != copy->data) {
+		memcpy(copy->data, data, BLOCK_SIZE);
+	}
+	block_put(b);
+	*slot = copy;
+	return copy;
+}
+
+//Double the buckets. If that fails the chains just get longer.
+static void grow_index(void) {
+	size_t size = nbuckets ? nbuckets * 2 : INITIAL_BUCKETS;
+	struct block **grown = calloc(size, sizeof(struct block *));
+	if (grown == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < nbuckets; i++) {
+		struct block *b = buckets[i];
+		while (b) {
+			struct block *next = b->next;
+			b->next = grown[b->hash & (size - 1)];
+			grown[b->hash & (size - 1)] = b;
+			b = next;
+		}
+	}
+	free(buckets);
+	buckets = grown;
+	nbuckets = size;
+}
+
+struct block *block_find(struct block *b) {
+	char scratch[BLOCK_SIZE], other_scratch[BLOCK_SIZE];
+	if (b->indexed) {
+		return b;
+	}
+	if (counts.indexed >= nbuckets) {
+		grow_index();
+		if (nbuckets == 0) {
+			return b;
+		}
+	}
+	//Evicted blocks are compared where they are, without bringing them back.
+	const char *data = block_peek(b, scratch);
+	if (data == NULL) {
+		return b;
+	}
+	b->hash = hash_block(data);
+	struct block **head = &buckets[b->hash & (nbuckets - 1)];
+	for (struct block *other = *head; other; other = other->next) {
+		const char *other_data;
+		if (other->hash == b->hash && (other_data = block_peek(other, other_scratch)) != NULL &&
+				memcmp(other_data, data, BLOCK_SIZE) == 0) {
+			return other;
+		}
+	}
+	b->next = *head;
+	*head = b;
+	b->indexed = true;
+	__atomic_add_fetch(&counts.indexed, 1, __ATOMIC_RELAXED);
+	return b;
+}
+
+struct block *block_dedup(struct block *b) {
+	struct block *found = block_find(b);
+	if (found != b) {
+		block_get(found);
+		block_put(b);
+		__atomic_add_fetch(&counts.dedup_hits, 1, __ATOMIC_RELAXED);
+	}
+	return found;
+}
+
+void block_saved(struct block *b, uint32_t gen, uint64_t offset) {
+	pthread_mutex_lock(&image_lock);
+	//Keep where the image on disk has it until the new one replaces it.
+	if (b->image_gen == image_saved) {
+		b->disk_gen = b->image_gen;
+		b->disk_offset = b->image_offset;
+	}
+	b->image_gen = gen;
+	b->image_offset = offset;
+	pthread_mutex_unlock(&image_lock);
+}
+
+void block_set_image(int fd, uint32_t gen) {
+	pthread_mutex_lock(&image_lock);
+	if (image_fd >= 0) {
+		close(image_fd);
+	}
+	image_fd = fd;
+	image_saved = gen;
+	pthread_mutex_unlock(&image_lock);
+}
+
+bool block_evict(struct block *b) {
+	uint64_t offset;
+	if (b->data == NULL || !image_location(b, &offset)) {
+		return false;
+	}
+	if (b->zlen) {
+		free(b->data);
+		__atomic_sub_fetch(&counts.compressed, 1, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&counts.compressed_bytes, b->zlen, __ATOMIC_RELAXED);
+		b->zlen = 0;
+	} else {
+		data_put(b->data);
+	}
+	b->data = NULL;
+	__atomic_add_fetch(&counts.evicted, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+size_t block_memory(void) {
+	struct block_stats s;
+	block_get_stats(&s);
+	return (s.blocks - s.compressed - s.evicted) * (size_t) BLOCK_SIZE + s.compressed_bytes;
+}
+
+void block_get_stats(struct block_stats *stats) {
+	stats->blocks = __atomic_load_n(&counts.blocks, __ATOMIC_RELAXED);
+	stats->refs = __atomic_load_n(&counts.refs, __ATOMIC_RELAXED);
+	stats->indexed = __atomic_load_n(&counts.indexed, __ATOMIC_RELAXED);
+	stats->dedup_hits = __atomic_load_n(&counts.dedup_hits, __ATOMIC_RELAXED);
+	stats->compressed = __atomic_load_n(&counts.compressed, __ATOMIC_RELAXED);
+	stats->compressed_bytes = __atomic_load_n(&counts.compressed_bytes, __ATOMIC_RELAXED);
+	stats->huge_chunks = __atomic_load_n(&data_arena.chunks, __ATOMIC_RELAXED);
+	stats->hugetlb_chunks = __atomic_load_n(&data_arena.hugetlb_chunks, __ATOMIC_RELAXED);
+	stats->evicted = __atomic_load_n(&counts.evicted, __ATOMIC_RELAXED);
+}
+
+size_t block_format_stats(char *buf, size_t size) {
+	struct block_stats s;
+	block_get_stats(&s);
+	size_t len = snprintf(buf, size,
+		"blocks      %12zu\n"
+		"refs        %12zu\n"
+		"indexed     %12zu\n"
+		"dedup_hits  %12llu\n"
+		"saved_bytes %12zu\n"
+		"compressed  %12zu\n"
+		"zbytes      %12zu\n"
+		"zratio      %12.2f\n"
+		"huge_chunks %12zu\n"
+		"hugetlb     %12zu\n"
+		"evicted     %12zu\n",
+		s.blocks, s.refs, s.indexed, (unsigned long long) s.dedup_hits,
+		(s.refs - s.blocks) * (size_t) BLOCK_SIZE,
+		s.compressed, s.compressed_bytes,
+		s.compressed_bytes ? (double) s.compressed * BLOCK_SIZE / s.compressed_bytes : 0.0,
+		s.huge_chunks, s.hugetlb_chunks, s.evicted);
+	return len < size ? len : size - 1;
+}
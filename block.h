@@ -0,0 +1,128 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// File data blocks, shared between files by content.
+//
+// A file is an array of pointers to blocks of BLOCK_SIZE bytes. A block can
+// be in any number of files, and at any number of places in one file; refs
+// counts them. Blocks that are written in full are looked up in an index
+// keyed by a hash of their contents, and a block with the same bytes that is
+// already there is shared instead of keeping a second copy. A shared block
+// is never changed, a write to it copies it first.
+//
+// A block that is not being used can be compressed. Its data then holds
+// zlen bytes from lz_compress, and block_read expands it for each read until
+// it is expanded for good by block_expand or a write.
+//
+// A block that is in the image on disk unchanged can be evicted: its data is
+// dropped and data is NULL until block_read brings it back from the image.
+// Each block remembers where it was written by the last two saves, so one
+// that is evicted can still be found in the image on disk while a newer one
+// is being written or after that one failed.
+
+#define BLOCK_SIZE 4096
+
+struct block {
+	char *data;
+	// next block in the same index bucket
+	struct block *next;
+	uint64_t hash;
+	uint32_t refs;
+	// length of the compressed data, 0 if the block is not compressed
+	uint16_t zlen;
+	bool indexed;
+	// compressing it saved too little, it is not tried again until written
+	bool incompressible;
+	// last compression pass that found the block in use, see compress_step
+	uint32_t hot_pass;
+	// number of the block in the image being written, valid if image_gen
+	// is the current save
+	uint32_t image_gen;
+	uint32_t image_id;
+	// where the block was written by save image_gen, and before that by
+	// save disk_gen; 0 when it has changed since
+	uint32_t disk_gen;
+	uint64_t image_offset;
+	uint64_t disk_offset;
+	// read or written since the evictor last passed it
+	bool referenced;
+};
+
+struct block_stats {
+	size_t blocks;		// blocks in memory
+	size_t refs;		// blocks in files, shared ones counted once per file
+	size_t indexed;
+	uint64_t dedup_hits;	// writes and loads that found their block already there
+	size_t compressed;	// compressed blocks
+	size_t compressed_bytes;	// memory they take
+	size_t huge_chunks;	// 2 MiB chunks of the hugepage arena
+	size_t hugetlb_chunks;	// of those, chunks from the hugetlb pool
+	size_t evicted;		// blocks whose data is only in the image
+};
+
+void block_init(void);
+
+// Take block data from a 2 MiB hugepage arena instead of the block pool.
+// Call it before the first block is made.
+void block_use_hugepages(void);
+
+// A new zeroed block with one reference, or NULL.
+struct block *block_new(void);
+
+void block_get(struct block *b);
+void block_put(struct block *b);
+
+// The BLOCK_SIZE bytes of b. A compressed block is expanded into scratch,
+// an evicted one read back from the image and kept again. Returns NULL if
+// the image could not be read.
+const char *block_read(struct block *b, char *scratch);
+
+// Like block_read, but an evicted block is only read into scratch.
+const char *block_peek(struct block *b, char *scratch);
+
+// Compress b if that saves at least a quarter of it. Returns true if b is
+// now compressed.
+bool block_compress(struct block *b);
+
+// Store b uncompressed again. Returns 0 or -ENOMEM.
+int block_expand(struct block *b);
+
+// Record that save gen wrote b at offset, where its length and bytes are.
+void block_saved(struct block *b, uint32_t gen, uint64_t offset);
+
+// Make fd, an image written by save gen, the one evicted blocks are read
+// back from. The previous one is closed.
+void block_set_image(int fd, uint32_t gen);
+
+// Drop the data of b if it is in the image unchanged. Returns true if it
+// was dropped. No block_read may run at the same time.
+bool block_evict(struct block *b);
+
+// Bytes of block data in memory.
+size_t block_memory(void);
+
+// Make *slot a block that can be written: a block only the caller holds and
+// that is not in the index, compressed or evicted. A shared block is copied
+// into a new one.
+// Returns the block or NULL if out of memory or the image could not be read,
+// *slot is then unchanged.
+struct block *block_writable(struct block **slot);
+
+// Index b by its contents. If an equal block is already indexed b is dropped
+// and a reference to the other is returned, otherwise b.
+struct block *block_dedup(struct block *b);
+
+// The indexed block equal to b, or b itself after adding it to the index.
+// Unlike block_dedup no reference moves, so files keep their blocks.
+struct block *block_find(struct block *b);
+
+void block_get_stats(struct block_stats *stats);
+
+// The stats as a report, returns the length written.
+size_t block_format_stats(char *buf, size_t size);
+
+#endif
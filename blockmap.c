@@ -0,0 +1,150 @@
+#include <string.h>
+
+#include "blockmap.h"
+#include "pool.h"
+
+#define INDEX_MASK (BLOCKMAP_FANOUT - 1)
+
+static struct pool node_pool;
+
+void blockmap_init(void) {
+	if (node_pool.name == NULL) {
+		pool_init(&node_pool, "blockmap", BLOCKMAP_FANOUT * sizeof(union blockmap_ptr));
+	}
+}
+
+static union blockmap_ptr *node_new(void) {
+	union blockmap_ptr *node = pool_get(&node_pool);
+	if (node) {
+		memset(node, 0, BLOCKMAP_FANOUT * sizeof(union blockmap_ptr));
+	}
+	return node;
+}
+
+//Number of blocks a subtree of height h covers.
+static inline uint64_t span(int h) {
+	return (uint64_t) 1 << (h * BLOCKMAP_SHIFT);
+}
+
+static inline unsigned index_at(uint64_t i, int h) {
+	return (i >> ((h - 1) * BLOCKMAP_SHIFT)) & INDEX_MASK;
+}
+
+struct block *blockmap_get(const struct blockmap *m, uint64_t i) {
+	if (i >= span(m->height)) {
+		return NULL;
+	}
+	union blockmap_ptr p = m->root;
+	for (int h = m->height; h > 0; h--) {
+		if (p.node == NULL) {
+			return NULL;
+		}
+		p = p.node[index_at(i, h)];
+	}
+	return p.block;
+}
+
+struct block **blockmap_slot(struct blockmap *m, uint64_t i, bool create) {
+	//Add levels on top until the tree covers block i. An empty tree has
+	//nothing to push down.
+	while (i >= span(m->height)) {
+		if (!create) {
+			return NULL;
+		}
+		if (m->root.node) {
+			union blockmap_ptr *node = node_new();
+			if (node == NULL) {
+				return NULL;
+			}
+			node[0] = m->root;
+			m->root.node = node;
+		}
+		m->height++;
+	}
+	union blockmap_ptr *p = &m->root;
+	for (int h = m->height; h > 0; h--) {
+		if (p->node == NULL && (!create || (p->node = node_new()) == NULL)) {
+			return NULL;
+		}
+		p = &p->node[index_at(i, h)];
+	}
+	return &p->block;
+}
+
+//Clear the blocks first up to end in the subtree at p of height h, whose
+//first block is base, and free it if nothing is left in it.
+static void clear(union blockmap_ptr *p, int h, uint64_t base, uint64_t first, uint64_t end) {
+	if (p->node == NULL) {
+		return;
+	}
+	if (h == 0) {
+		block_put(p->block);
+		p->block = NULL;
+		return;
+	}
+	uint64_t child = span(h - 1);
+	bool empty = true;
+	for (int k = 0; k < BLOCKMAP_FANOUT; k++) {
+		uint64_t lo = base + k * child;
+		if (lo < end && lo + child > first) {
+			clear(&p->node[k], h - 1, lo, first, end);
+		}
+		empty &= p->node[k].node == NULL;
+	}
+	if (empty) {
+		pool_put(&node_pool, p->node);
+		p->node = NULL;
+	}
+}
+
+void blockmap_clear(struct blockmap *m, uint64_t first, uint64_t end) {
+	if (first < span(m->height) && first < end) {
+		clear(&m->root, m->height, 0, first, end);
+	}
+	//Drop levels whose root only has a first child.
+	while (m->height > 0 && m->root.node) {
+		union blockmap_ptr *node = m->root.node;
+		int k = 1;
+		while (k < BLOCKMAP_FANOUT && node[k].node == NULL) {
+			k++;
+		}
+		if (k < BLOCKMAP_FANOUT) {
+			break;
+		}
+		m->root = node[0];
+		pool_put(&node_pool, node);
+		m->height--;
+	}
+	if (m->root.node == NULL) {
+		m->height = 0;
+	}
+}
+
+//The first block number from i up to end in the subtree at p of height h,
+//whose first block is base, that is a block or a hole. UINT64_MAX if none.
+static uint64_t next(const union blockmap_ptr *p, int h, uint64_t base, uint64_t i, uint64_t end, bool data) {
+	if (p->node == NULL) {
+		return data ? UINT64_MAX : (i > base ? i : base);
+	}
+	if (h == 0) {
+		return data ? base : UINT64_MAX;
+	}
+	uint64_t child = span(h - 1);
+	for (uint64_t k = i > base ? (i - base) / child : 0; k < BLOCKMAP_FANOUT && base + k * child < end; k++) {
+		uint64_t found = next(&p->node[k], h - 1, base + k * child, i, end, data);
+		if (found != UINT64_MAX) {
+			return found;
+		}
+	}
+	return UINT64_MAX;
+}
+
+uint64_t blockmap_next(const struct blockmap *m, uint64_t i, uint64_t end, bool data) {
+	uint64_t covered = span(m->height);
+	uint64_t found = i < covered ? next(&m->root, m->height, 0, i, end, data) : UINT64_MAX;
+	//Past what the tree covers is all holes.
+	if (found == UINT64_MAX && !data) {
+		found = i > covered ? i : covered;
+	}
+	return found < end ? found : end;
+}
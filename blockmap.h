@@ -0,0 +1,52 @@
+#ifndef BLOCKMAP_H
+#define BLOCKMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "block.h"
+
+// Map from block numbers in a file to its blocks.
+//
+// A radix tree whose nodes hold BLOCKMAP_FANOUT pointers. A tree of height h
+// covers the first BLOCKMAP_FANOUT^h blocks; at height 0 the root is the
+// only block. Finding a block walks one node per level, so a block of a
+// 100 GiB file is four steps away, and a part of the file that is all holes
+// takes no nodes: its pointer is NULL. The tree grows a level when a block
+// past what it covers is added and shrinks when truncated.
+
+#define BLOCKMAP_SHIFT 7
+#define BLOCKMAP_FANOUT (1 << BLOCKMAP_SHIFT)
+
+// Files can have this many blocks, a height of 6.
+#define BLOCKMAP_MAX_BLOCKS ((uint64_t) 1 << (6 * BLOCKMAP_SHIFT))
+
+union blockmap_ptr {
+	struct block *block;
+	union blockmap_ptr *node;
+};
+
+struct blockmap {
+	union blockmap_ptr root;
+	int height;
+};
+
+void blockmap_init(void);
+
+// Block i, NULL for a hole.
+struct block *blockmap_get(const struct blockmap *m, uint64_t i);
+
+// Where block i is kept, so it can be replaced. With create the nodes on the
+// way are added, otherwise NULL is returned if block i is in a part that is
+// all holes. NULL if out of memory.
+struct block **blockmap_slot(struct blockmap *m, uint64_t i, bool create);
+
+// Put the blocks from first up to end and free the nodes that are left
+// without blocks. An end of UINT64_MAX truncates the file to first blocks.
+void blockmap_clear(struct blockmap *m, uint64_t first, uint64_t end);
+
+// The first block number from i up to end that is a block, or with data
+// false a hole. end if there is none.
+uint64_t blockmap_next(const struct blockmap *m, uint64_t i, uint64_t end, bool data);
+
+#endif
@@ -0,0 +1,1793 @@
+// fopencookie
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <linux/falloc.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "blockmap.h"
+#include "core.h"
+#include "dirtree.h"
+#include "pool.h"
+#include "log.h"
+#include "stats.h"
+
+// Initial size of the entry table, it doubles when full.
+#define INITIAL_ENTRIES 1024
+
+// Images start with the magic and version, then the number of entries.
+// Version 1 images had no header and started with the number of entries,
+// the magic is negative so they can still be told apart and read.
+#define IMAGE_MAGIC ((int32_t) 0x8c53464c)
+#define IMAGE_VERSION 5
+
+// Block number of a run of holes in the image, followed by its length.
+#define IMAGE_HOLE UINT32_MAX
+
+// Entries live in a table indexed by inode number, inode 0 is the root.
+// The attributes that getattr, readdir, statfs and the flusher read for
+// every entry are kept in dense, cache line aligned arrays of their own, so
+// scanning them streams through memory. Names, file data and directory
+// indexes are in struct entry.
+#define ENTRY_USED 1
+#define ENTRY_DIR 2
+#define ENTRY_INLINE 4
+#define ENTRY_PENDING 8	// a handle holds writes to it, see struct handle
+#define ENTRY_UNLINKED 16	// removed from its directory, still open
+#define ENTRY_RESERVED 32	// fallocate gave it blocks, it stays out of the entry
+
+// Files of up to this many bytes keep their data in the entry instead of
+// blocks, so reading one touches nothing else. It fills struct entry up to
+// 256 bytes.
+#define INLINE_MAX 216
+
+// Largest file size, what a block map can hold.
+#define MAX_FILE_SIZE ((off_t) (BLOCKMAP_MAX_BLOCKS * BLOCK_SIZE))
+
+struct entry {
+	char *name;
+	// names in the directory, NULL for files.
+	struct dirtree *children;
+	// bumped on every change to data; cached_version is the value the
+	// kernel page cache was filled from on the last open.
+	unsigned long version;
+	unsigned long cached_version;
+	int parent;
+	// handles open on the entry; it is only released once there are none
+	int opens;
+	union {
+		// ENTRY_INLINE: the bytes of the file, zero past its size.
+		char data[INLINE_MAX];
+		// otherwise blocks of BLOCK_SIZE bytes, NULL for a hole that
+		// reads as zeros. Bytes past the file size in the last block are
+		// always zero.
+		struct blockmap map;
+	};
+};
+
+static uint8_t *entry_flags;
+static off_t *entry_size;
+static time_t *entry_atime;
+static time_t *entry_mtime;
+static struct entry *entries;
+static int entries_size = 0;
+static int entries_count = 0;
+static int free_hint = 1;
+
+// Bumped for every image written, see struct block.
+static uint32_t image_gen;
+
+// Bumped for every compression pass, see struct block.
+static uint32_t compress_pass;
+
+// Compressed blocks are expanded here for reads.
+static __thread char read_scratch[BLOCK_SIZE];
+
+static inline bool is_dir(int ino) {
+	return entry_flags[ino] & ENTRY_DIR;
+}
+
+//Write the path of ino into buf, returns its length.
+size_t entry_path(int ino, char *buf, size_t size) {
+	size_t len = entries[ino].parent ? entry_path(entries[ino].parent, buf, size) : 0;
+	size_t n = strlen(entries[ino].name);
+	if (len + n + 2 > size) {
+		return len;
+	}
+	buf[len++] = '/';
+	memcpy(buf + len, entries[ino].name, n + 1);
+	return len + n;
+}
+
+char* get_parent_path(const char* path) {
+    char* last_slash = strrchr(path, '/');
+    if (last_slash == NULL) {
+        return NULL;
+    }
+    int parent_len = last_slash - path;
+    char* parent_path = pool_strndup(path, parent_len + 1);
+    return parent_path;
+}
+
+//Move one table array to a bigger, cache line aligned allocation.
+static int grow_array(void **array, size_t elem, int old_size, int new_size) {
+	void *grown;
+	if (posix_memalign(&grown, 64, new_size * elem) != 0) {
+		return -ENOMEM;
+	}
+	if (*array) {
+		memcpy(grown, *array, old_size * elem);
+	}
+	memset((char*) grown + old_size * elem, 0, (new_size - old_size) * elem);
+	free(*array);
+	*array = grown;
+	return 0;
+}
+
+static int grow_entries(int new_size) {
+	if (grow_array((void**) &entry_flags, sizeof(uint8_t), entries_size, new_size) ||
+			grow_array((void**) &entry_size, sizeof(off_t), entries_size, new_size) ||
+			grow_array((void**) &entry_atime, sizeof(time_t), entries_size, new_size) ||
+			grow_array((void**) &entry_mtime, sizeof(time_t), entries_size, new_size) ||
+			grow_array((void**) &entries, sizeof(struct entry), entries_size, new_size)) {
+		return -ENOMEM;
+	}
+	entries_size = new_size;
+	return 0;
+}
+
+//Find a free inode, growing the table when it is full.
+int find_empty_entry() {
+	for (int i = free_hint; i < entries_size; i++) {
+		if (!(entry_flags[i] & ENTRY_USED)) {
+			free_hint = i + 1;
+			return i;
+		}
+	}
+
+	int old_size = entries_size;
+	if (grow_entries(entries_size ? entries_size * 2 : INITIAL_ENTRIES) != 0) {
+		lfs_log(LOG_ERROR, LOG_META, "no more space for entries", NULL, entries_size, 0);
+		return -1;
+	}
+	free_hint = old_size + 1;
+	return old_size;
+}
+
+char* get_entry_name(const char *path) {
+	const char *name = strrchr(path, '/');
+	if (name == NULL) {
+		return pool_strdup(path);
+	}
+	name = name + 1;
+    return pool_strdup(name);
+}
+
+//Walk the path from the root one directory at a time.
+//Returns the inode, 0 for "/", or -ENOENT / -ENOTDIR.
+int get_entry(const char *path) {
+	int ino = 0;
+
+	while (*path) {
+		while (*path == '/') {
+			path++;
+		}
+		if (*path == '\0') {
+			break;
+		}
+		const char *end = strchr(path, '/');
+		if (end == NULL) {
+			end = path + strlen(path);
+		}
+		if (!is_dir(ino)) {
+			return -ENOTDIR;
+		}
+		ino = (intptr_t) dirtree_lookup(entries[ino].children, path, end - path);
+		if (ino == 0) {
+			return -ENOENT;
+		}
+		path = end;
+	}
+	return ino;
+}
+
+//Set up the table with the root directory in inode 0.
+static int init_entries() {
+	if (entries_size == 0 && grow_entries(INITIAL_ENTRIES) != 0) {
+		return -ENOMEM;
+	}
+	entries[0].name = pool_strdup("");
+	entries[0].children = dirtree_new();
+	if (entries[0].children == NULL) {
+		return -ENOMEM;
+	}
+	entry_flags[0] = ENTRY_USED | ENTRY_DIR;
+	entry_atime[0] = time(NULL);
+	entry_mtime[0] = time(NULL);
+	return 0;
+}
+
+//Move the data of an inline file into a first block, a hole if it is empty.
+static int inline_to_blocks(int ino) {
+	struct entry *e = &entries[ino];
+	struct block *b = NULL;
+	if (entry_size[ino] > 0) {
+		b = block_new();
+		if (b == NULL) {
+			return -ENOMEM;
+		}
+		memcpy(b->data, e->data, entry_size[ino]);
+	}
+	memset(&e->map, 0, sizeof(e->map));
+	e->map.root.block = b;
+	entry_flags[ino] &= ~ENTRY_INLINE;
+	return 0;
+}
+
+//Move the first size bytes of a file out of its blocks into the entry and
+//drop the blocks. size is at most INLINE_MAX. Returns 0 or -EIO.
+static int blocks_to_inline(int ino, off_t size) {
+	struct entry *e = &entries[ino];
+	char data[INLINE_MAX] = { 0 };
+	struct block *first = blockmap_get(&e->map, 0);
+	if (size > 0 && first) {
+		const char *bytes = block_peek(first, read_scratch);
+		if (bytes == NULL) {
+			return -EIO;
+		}
+		memcpy(data, bytes, size);
+	}
+	blockmap_clear(&e->map, 0, UINT64_MAX);
+	memcpy(e->data, data, INLINE_MAX);
+	entry_flags[ino] |= ENTRY_INLINE;
+	return 0;
+}
+
+//Make the file size bytes long. Growing adds holes, which take no room, or
+//uses the blocks that fallocate left past the end. Shrinking drops the
+//blocks past the end and clears the tail of the new last block. Files move
+//into and out of the entry as they cross INLINE_MAX, except that a file
+//with reserved blocks keeps them until it shrinks.
+int resize_data(int ino, off_t size) {
+	struct entry *e = &entries[ino];
+	uint64_t need = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	if (entry_flags[ino] & ENTRY_INLINE) {
+		if (size <= INLINE_MAX) {
+			if (size < entry_size[ino]) {
+				memset(e->data + size, 0, entry_size[ino] - size);
+			}
+			entry_size[ino] = size;
+			return 0;
+		}
+		if (inline_to_blocks(ino) != 0) {
+			return -ENOMEM;
+		}
+	} else if (size < entry_size[ino]) {
+		entry_flags[ino] &= ~ENTRY_RESERVED;
+	}
+	if (size <= INLINE_MAX && !(entry_flags[ino] & (ENTRY_INLINE | ENTRY_RESERVED))) {
+		if (blocks_to_inline(ino, size) != 0) {
+			return -EIO;
+		}
+		entry_size[ino] = size;
+		return 0;
+	}
+
+	if (size < entry_size[ino]) {
+		blockmap_clear(&e->map, need, UINT64_MAX);
+		struct block **last = blockmap_slot(&e->map, need - 1, false);
+		if (size % BLOCK_SIZE && last && *last) {
+			struct block *b = block_writable(last);
+			if (b == NULL) {
+				return -ENOMEM;
+			}
+			memset(b->data + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+		}
+	}
+	entry_size[ino] = size;
+	return 0;
+}
+
+//Copy size bytes at offset out of the file. The range must be inside the file.
+//Returns 0 or -EIO if an evicted block could not be read back.
+int read_data(int ino, char *buf, size_t size, off_t offset) {
+	if (entry_flags[ino] & ENTRY_INLINE) {
+		memcpy(buf, entries[ino].data + offset, size);
+		return 0;
+	}
+	struct blockmap *map = &entries[ino].map;
+	while (size > 0) {
+		size_t in = offset % BLOCK_SIZE;
+		size_t n = BLOCK_SIZE - in < size ? BLOCK_SIZE - in : size;
+		struct block *b = blockmap_get(map, offset / BLOCK_SIZE);
+		if (b) {
+			const char *data = block_read(b, read_scratch);
+			if (data == NULL) {
+				return -EIO;
+			}
+			memcpy(buf, data + in, n);
+			__atomic_store_n(&b->referenced, true, __ATOMIC_RELAXED);
+		} else {
+			memset(buf, 0, n);
+		}
+		buf += n;
+		offset += n;
+		size -= n;
+	}
+	return 0;
+}
+
+//Copy size bytes into the file at offset. The range must be inside the file.
+//Holes get a block, shared blocks are copied before they are written, and
+//every block written up to its end is shared with an equal block if there
+//is one.
+int write_data(int ino, const char *buf, size_t size, off_t offset) {
+	if (entry_flags[ino] & ENTRY_INLINE) {
+		memcpy(entries[ino].data + offset, buf, size);
+		return 0;
+	}
+	struct blockmap *map = &entries[ino].map;
+	while (size > 0) {
+		size_t in = offset % BLOCK_SIZE;
+		size_t n = BLOCK_SIZE - in < size ? BLOCK_SIZE - in : size;
+		struct block **slot = blockmap_slot(map, offset / BLOCK_SIZE, true);
+		if (slot == NULL || (*slot == NULL && (*slot = block_new()) == NULL)) {
+			return -ENOMEM;
+		}
+		struct block *b = block_writable(slot);
+		if (b == NULL) {
+			return -ENOMEM;
+		}
+		memcpy(b->data + in, buf, n);
+		b->referenced = true;
+		if (in + n == BLOCK_SIZE) {
+			*slot = block_dedup(b);
+		}
+		buf += n;
+		offset += n;
+		size -= n;
+	}
+	return 0;
+}
+
+// An open file, what fi->fh points to. Small writes that each continue the
+// last one through the handle are gathered in buf and go into the file
+// together: when buf is full, before any other op that changes the file,
+// and on flush, fsync and release. The file size already includes them, and
+// reads copy them over what is in the file. At most one handle of a file
+// holds writes, those of another one go in first. Writes that cannot go in
+// stay in buf, and the next flush, fsync or release of the handle reports
+// the error.
+struct handle {
+	int ino;
+	// where the last write through the handle ended
+	off_t end;
+	// len bytes to write at start; buf only exists while len > 0 and holds
+	// cap bytes
+	off_t start;
+	size_t len;
+	size_t cap;
+	char *buf;
+	// a flush of the handle failed since its owner last asked
+	int err;
+	// handles that hold writes
+	struct handle *next;
+};
+
+int write_buffer = DEFAULT_WRITE_BUFFER;
+int write_buffers = DEFAULT_WRITE_BUFFERS;
+
+static struct handle *pending;
+static int pending_count;
+
+static inline struct handle *get_handle(struct fuse_file_info *fi) {
+	return (struct handle *) (uintptr_t) fi->fh;
+}
+
+//The handle that holds writes to ino, or NULL.
+static struct handle *pending_handle(int ino) {
+	if (!(entry_flags[ino] & ENTRY_PENDING)) {
+		return NULL;
+	}
+	struct handle *h = pending;
+	while (h && h->ino != ino) {
+		h = h->next;
+	}
+	return h;
+}
+
+//Forget the writes h holds.
+static void drop_pending(struct handle *h) {
+	struct handle **p = &pending;
+	while (*p != h) {
+		p = &(*p)->next;
+	}
+	*p = h->next;
+	pending_count--;
+	entry_flags[h->ino] &= ~ENTRY_PENDING;
+	free(h->buf);
+	h->buf = NULL;
+	h->len = 0;
+}
+
+//Write what h holds into its file and free its buffer. Returns 0 or
+//-ENOMEM, the writes are then kept to be tried again.
+static int flush_handle(struct handle *h) {
+	if (h->len == 0) {
+		return 0;
+	}
+	int err = write_data(h->ino, h->buf, h->len, h->start);
+	if (err) {
+		h->err = err;
+		return err;
+	}
+	drop_pending(h);
+	return 0;
+}
+
+//Flush h for its owner: also report a failed flush since it last asked.
+static int flush_own(struct handle *h) {
+	int err = flush_handle(h);
+	if (err == 0) {
+		err = h->err;
+	}
+	h->err = 0;
+	return err;
+}
+
+//Put the writes a handle holds to ino into the file before an op that needs
+//it as it is.
+static int flush_ino(int ino) {
+	struct handle *h = pending_handle(ino);
+	return h ? flush_handle(h) : 0;
+}
+
+int flush_handles(void) {
+	int err = 0;
+	struct handle *h = pending;
+	while (h) {
+		struct handle *next = h->next;
+		int res = flush_handle(h);
+		err = err ? err : res;
+		h = next;
+	}
+	return err;
+}
+
+//Create an entry at path and add it to its parent. Returns the inode or -errno.
+int new_entry(const char *path, bool dir) {
+	char *parent_path = get_parent_path(path);
+	int parent = get_entry(parent_path);
+	pool_free_str(parent_path);
+	if (parent < 0) {
+		return parent;
+	}
+	if (!is_dir(parent)) {
+		return -ENOTDIR;
+	}
+
+	int ino = find_empty_entry();
+	if (ino == -1) {
+		return -ENOSPC;
+	}
+	struct entry *e = &entries[ino];
+	memset(e, 0, sizeof(struct entry));
+	e->name = get_entry_name(path);
+	e->parent = parent;
+	e->version = 1;
+	if (dir) {
+		e->children = dirtree_new();
+	}
+	if (e->name == NULL || (dir && e->children == NULL)) {
+		pool_free_str(e->name);
+		dirtree_free(e->children);
+		return -ENOMEM;
+	}
+
+	int err = dirtree_insert(entries[parent].children, e->name, (void*) (intptr_t) ino);
+	if (err) {
+		pool_free_str(e->name);
+		dirtree_free(e->children);
+		return err;
+	}
+	entry_flags[ino] = ENTRY_USED | (dir ? ENTRY_DIR : ENTRY_INLINE);
+	entry_size[ino] = 0;
+	entry_atime[ino] = time(NULL);
+	entry_mtime[ino] = time(NULL);
+	entries_count++;
+	return ino;
+}
+
+//Give back everything ino holds and mark the inode free.
+void release_entry(int ino) {
+	struct entry *e = &entries[ino];
+	dirtree_free(e->children);
+	resize_data(ino, 0);
+	pool_free_str(e->name);
+	memset(e, 0, sizeof(struct entry));
+	entry_flags[ino] = 0;
+	if (ino < free_hint) {
+		free_hint = ino;
+	}
+}
+
+int core_init(void) {
+	block_init();
+	blockmap_init();
+	return init_entries();
+}
+
+void mark_changed(int ino) {
+	entries[ino].version++;
+}
+
+void (*lfs_invalidate_hook)(const char *path, int what);
+
+static void invalidate(const char *path, int what) {
+	if (lfs_invalidate_hook) {
+		lfs_invalidate_hook(path, what);
+	}
+}
+
+//A name was added or removed: drop it and the attributes and listing of
+//its directory.
+static void invalidate_name(const char *path) {
+	if (lfs_invalidate_hook == NULL) {
+		return;
+	}
+	invalidate(path, LFS_INVAL_ENTRY);
+	char *parent = get_parent_path(path);
+	size_t len = strlen(parent);
+	//Without the trailing slash, except for the root.
+	char *dir = len > 1 ? pool_strndup(parent, len - 1) : NULL;
+	if (len <= 1 || dir) {
+		invalidate(dir ? dir : parent, LFS_INVAL_INODE);
+	}
+	pool_free_str(dir);
+	pool_free_str(parent);
+}
+
+//A block is only compressed if no file used since cutoff holds it, in this
+//pass or the one before, so a block shared by a cold and a hot file is not
+//compressed and expanded again on every pass.
+bool compress_step(time_t cutoff, struct compress_cursor *cur, int budget) {
+	if (cur->ino == 0 && cur->block == 0) {
+		compress_pass++;
+	}
+	for (; cur->ino < entries_size && budget > 0; cur->ino++, cur->block = 0) {
+		int ino = cur->ino;
+		budget--;
+		if ((entry_flags[ino] & (ENTRY_USED | ENTRY_DIR | ENTRY_INLINE | ENTRY_UNLINKED)) != ENTRY_USED) {
+			continue;
+		}
+		struct entry *e = &entries[ino];
+		bool cold = entry_atime[ino] < cutoff;
+		for (; budget > 0; cur->block++) {
+			cur->block = blockmap_next(&e->map, cur->block, UINT64_MAX, true);
+			if (cur->block == UINT64_MAX) {
+				break;
+			}
+			struct block *b = blockmap_get(&e->map, cur->block);
+			if (!cold) {
+				b->hot_pass = compress_pass;
+				if (b->zlen) {
+					block_expand(b);
+					budget--;
+				}
+			} else if (!b->zlen && !b->incompressible && b->hot_pass + 1 < compress_pass) {
+				block_compress(b);
+				budget--;
+			}
+		}
+		if (cur->block != UINT64_MAX) {
+			return false;
+		}
+	}
+	if (cur->ino < entries_size) {
+		return false;
+	}
+	cur->ino = 0;
+	cur->block = 0;
+	return true;
+}
+
+//A clock over the blocks of all files. Dirty blocks cannot be evicted, they
+//are not in the image yet.
+int evict_step(size_t limit, time_t cutoff, struct evict_cursor *cur, int budget) {
+	if (block_memory() <= limit) {
+		cur->sweep = 0;
+		return 1;
+	}
+	for (; cur->ino < entries_size && budget > 0; cur->ino++, cur->block = 0) {
+		int ino = cur->ino;
+		budget--;
+		if ((entry_flags[ino] & (ENTRY_USED | ENTRY_DIR | ENTRY_INLINE | ENTRY_UNLINKED)) != ENTRY_USED ||
+				(cur->sweep == 0 && entry_atime[ino] >= cutoff)) {
+			continue;
+		}
+		struct entry *e = &entries[ino];
+		for (; budget > 0; cur->block++) {
+			cur->block = blockmap_next(&e->map, cur->block, UINT64_MAX, true);
+			if (cur->block == UINT64_MAX) {
+				break;
+			}
+			struct block *b = blockmap_get(&e->map, cur->block);
+			budget--;
+			if (b->referenced) {
+				b->referenced = false;
+			} else if (block_evict(b) && block_memory() <= limit) {
+				cur->block++;
+				cur->sweep = 0;
+				return 1;
+			}
+		}
+		if (cur->block != UINT64_MAX) {
+			return 0;
+		}
+	}
+	if (cur->ino < entries_size) {
+		return 0;
+	}
+	cur->ino = 0;
+	cur->block = 0;
+	if (++cur->sweep == 2) {
+		cur->sweep = 0;
+		return -1;
+	}
+	return 0;
+}
+
+//Remove ino from its parent and release it, or if it is still open, when
+//the last handle on it is released. Until then it is not in the image.
+void free_entry(int ino) {
+	dirtree_remove(entries[entries[ino].parent].children, entries[ino].name);
+	entries_count--;
+	if (entries[ino].opens > 0) {
+		entry_flags[ino] |= ENTRY_UNLINKED;
+		//It is left out of the next image, where its evicted blocks would
+		//be read back from, so they come back into memory now.
+		if ((entry_flags[ino] & (ENTRY_DIR | ENTRY_INLINE)) == 0) {
+			struct blockmap *map = &entries[ino].map;
+			for (uint64_t i = blockmap_next(map, 0, UINT64_MAX, true); i != UINT64_MAX;
+					i = blockmap_next(map, i + 1, UINT64_MAX, true)) {
+				struct block *b = blockmap_get(map, i);
+				if (b->data == NULL && block_read(b, NULL) == NULL) {
+					lfs_log(LOG_ERROR, LOG_DATA, "unlink: evicted block not read back", NULL, ino, i);
+				}
+			}
+		}
+		return;
+	}
+	release_entry(ino);
+}
+
+//Fill stbuf with the attributes of ino.
+static void fill_stat(int ino, struct stat *stbuf) {
+	memset( stbuf, 0, sizeof(struct stat) );
+
+	if (is_dir(ino)) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+	}
+	else {
+		stbuf->st_mode = S_IFREG | 0777;
+		stbuf->st_nlink = 1;
+		stbuf->st_size = entry_size[ino];
+	}
+	stbuf->st_atime = entry_atime[ino];
+	stbuf->st_mtime = entry_mtime[ino];
+	stbuf->st_ctime = entry_mtime[ino];
+}
+
+int lfs_getattr( const char *path, struct stat *stbuf, struct fuse_file_info *fi ) {
+	lfs_log(LOG_TRACE, LOG_META, "getattr", path, 0, 0);
+
+	int ino = get_entry(path);
+	if (ino < 0) {
+		lfs_log(LOG_DEBUG, LOG_META, "getattr failed", path, ino, 0);
+		return ino;
+	}
+	fill_stat(ino, stbuf);
+	return 0;
+}
+
+//Directory offsets are stable keys from the directory index, so a listing
+//that does not fit in one reply resumes right after the last name sent.
+int lfs_readdir( const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags ) {
+	lfs_log(LOG_TRACE, LOG_DIR, "readdir (offset, flags)", path, offset, flags);
+
+	//With readdirplus the kernel wants full attributes with every name.
+	bool plus = flags & FUSE_READDIR_PLUS;
+	enum fuse_fill_dir_flags fill_flags = plus ? FUSE_FILL_DIR_PLUS : 0;
+	struct stat st;
+
+	int dir = get_entry(path);
+	if (dir < 0) {
+		lfs_log(LOG_DEBUG, LOG_DIR, "readdir failed", path, dir, 0);
+		return dir;
+	}
+	if (!is_dir(dir)) {
+		return -ENOTDIR;
+	}
+
+	if (offset < 1 && filler(buf, ".", NULL, 1, 0)) {
+		return 0;
+	}
+	if (offset < 2 && filler(buf, "..", NULL, 2, 0)) {
+		return 0;
+	}
+
+	//Send names until the reply buffer is full.
+	struct dirtree_iter it;
+	void *value;
+	uint64_t key;
+	dirtree_seek(entries[dir].children, offset < 2 ? 2 : offset, &it);
+	while ((value = dirtree_next(&it, &key)) != NULL) {
+		int ino = (intptr_t) value;
+		if (plus) {
+			fill_stat(ino, &st);
+		}
+		if (filler(buf, entries[ino].name, plus ? &st : NULL, key, fill_flags)) {
+			break;
+		}
+	}
+
+	return 0;
+}
+
+//Create a file node
+int lfs_mknod(const char *path, mode_t mode, dev_t rdev) {
+	lfs_log(LOG_TRACE, LOG_META, "mknod", path, mode, 0);
+	int ino = new_entry(path, false);
+	if (ino < 0) {
+		lfs_log(LOG_DEBUG, LOG_META, "mknod failed", path, ino, 0);
+		return ino;
+	}
+	invalidate_name(path);
+	return 0;
+}
+
+int lfs_unlink(const char *path) {
+	lfs_log(LOG_TRACE, LOG_META, "unlink", path, 0, 0);
+	//Find the entry
+	int ino = get_entry(path);
+	if (ino < 0) {
+		lfs_log(LOG_DEBUG, LOG_META, "unlink failed", path, ino, 0);
+		return ino;
+	}
+	if (is_dir(ino)) {
+		lfs_log(LOG_DEBUG, LOG_META, "unlink failed", path, -EISDIR, 0);
+		return -EISDIR;
+	}
+	//Remove the entry
+	free_entry(ino);
+	invalidate_name(path);
+	return 0;
+}
+
+int lfs_open( const char *path, struct fuse_file_info *fi ) {
+	lfs_log(LOG_TRACE, LOG_DATA, "open (flags)", path, fi->flags, 0);
+
+	int ino = get_entry(path);
+	if (ino < 0) {
+		lfs_log(LOG_DEBUG, LOG_DATA, "open failed", path, ino, 0);
+		return ino;
+	}
+	struct handle *h = calloc(1, sizeof(struct handle));
+	if (h == NULL) {
+		return -ENOMEM;
+	}
+	h->ino = ino;
+	fi->fh = (uintptr_t) h;
+	entries[ino].opens++;
+
+	//The kernel page cache is still good if the file has not changed since
+	//it was filled. The mount may still choose not to keep it.
+	struct entry *e = &entries[ino];
+	if (e->cached_version == e->version) {
+		fi->keep_cache = 1;
+	}
+	e->cached_version = e->version;
+	return 0;
+}
+
+int lfs_read( const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi ) {
+	lfs_log(LOG_TRACE, LOG_DATA, "read (size, offset)", path, size, offset);
+
+	int ino = get_handle(fi)->ino;
+	if (offset >= entry_size[ino]) {
+		return 0;
+	}
+	if (size > entry_size[ino] - offset) {
+		size = entry_size[ino] - offset;
+	}
+
+	if (read_data(ino, buf, size, offset) != 0) {
+		lfs_log(LOG_ERROR, LOG_DATA, "read: could not read evicted block", path, size, offset);
+		return -EIO;
+	}
+	//Reads run side by side and cannot flush, writes a handle holds are
+	//copied over.
+	struct handle *h = pending_handle(ino);
+	if (h && h->start < offset + (off_t) size && h->start + (off_t) h->len > offset) {
+		off_t from = h->start > offset ? h->start : offset;
+		off_t to = h->start + (off_t) h->len < offset + (off_t) size ? h->start + (off_t) h->len : offset + (off_t) size;
+		memcpy(buf + (from - offset), h->buf + (from - h->start), to - from);
+	}
+	//Reads of one file can run side by side in the mount, see op_read.
+	__atomic_store_n(&entry_atime[ino], time(NULL), __ATOMIC_RELAXED);
+
+	return size;
+}
+
+//Find the next data or hole at or after offset for SEEK_DATA and SEEK_HOLE.
+//Inline files are all data, and the end of a file counts as a hole. So are
+//files a handle holds writes to, their holes are not known yet.
+off_t lfs_lseek(const char *path, off_t offset, int whence, struct fuse_file_info *fi) {
+	lfs_log(LOG_TRACE, LOG_DATA, "lseek (offset, whence)", path, offset, whence);
+
+	int ino = fi ? get_handle(fi)->ino : get_entry(path);
+	if (ino < 0) {
+		return ino;
+	}
+	if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+		return -EINVAL;
+	}
+	if (offset < 0 || offset >= entry_size[ino]) {
+		return -ENXIO;
+	}
+	if (entry_flags[ino] & (ENTRY_INLINE | ENTRY_PENDING)) {
+		return whence == SEEK_DATA ? offset : entry_size[ino];
+	}
+
+	uint64_t end = (entry_size[ino] + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	uint64_t i = blockmap_next(&entries[ino].map, offset / BLOCK_SIZE, end, whence == SEEK_DATA);
+	if (i == end) {
+		return whence == SEEK_DATA ? -ENXIO : entry_size[ino];
+	}
+	off_t start = (off_t) i * BLOCK_SIZE;
+	return start > offset ? start : offset;
+}
+
+//Zero the bytes from up to to, which are in one block. A hole stays a hole.
+static int zero_part(struct entry *e, off_t from, off_t to) {
+	struct block **slot = blockmap_slot(&e->map, from / BLOCK_SIZE, false);
+	if (slot == NULL || *slot == NULL) {
+		return 0;
+	}
+	struct block *b = block_writable(slot);
+	if (b == NULL) {
+		return -ENOMEM;
+	}
+	memset(b->data + from % BLOCK_SIZE, 0, to - from);
+	return 0;
+}
+
+//Zero size bytes at offset, dropping the blocks the range covers in full.
+static int punch_hole(int ino, off_t offset, off_t size) {
+	struct entry *e = &entries[ino];
+	if (entry_flags[ino] & ENTRY_INLINE) {
+		memset(e->data + offset, 0, size);
+		return 0;
+	}
+	off_t end = offset + size;
+	uint64_t first = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE, last = end / BLOCK_SIZE;
+	off_t head_end = (off_t) first * BLOCK_SIZE < end ? (off_t) first * BLOCK_SIZE : end;
+	if (offset % BLOCK_SIZE && zero_part(e, offset, head_end) != 0) {
+		return -ENOMEM;
+	}
+	if (end % BLOCK_SIZE && last >= first && zero_part(e, (off_t) last * BLOCK_SIZE, end) != 0) {
+		return -ENOMEM;
+	}
+	blockmap_clear(&e->map, first, last);
+	return 0;
+}
+
+//Give every hole in the blocks first to last a zeroed block of its own, so
+//writes there only copy.
+static int reserve_range(int ino, uint64_t first, uint64_t last) {
+	struct entry *e = &entries[ino];
+	for (uint64_t i = blockmap_next(&e->map, first, last + 1, false); i <= last;
+			i = blockmap_next(&e->map, i + 1, last + 1, false)) {
+		struct block **slot = blockmap_slot(&e->map, i, true);
+		if (slot == NULL || (*slot = block_new()) == NULL) {
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+//Reserve memory for a range of the file, growing it unless
+//FALLOC_FL_KEEP_SIZE is given, or punch a hole in it. Reserved blocks past
+//the end are kept while the file does not shrink, but are not saved.
+int lfs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+	lfs_log(LOG_TRACE, LOG_DATA, "fallocate (offset, length)", path, offset, length);
+
+	int ino = fi ? get_handle(fi)->ino : get_entry(path);
+	if (ino < 0) {
+		return ino;
+	}
+	if (is_dir(ino)) {
+		return -EISDIR;
+	}
+	if (offset < 0 || length <= 0) {
+		return -EINVAL;
+	}
+	if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) {
+		return -EOPNOTSUPP;
+	}
+	if (length > MAX_FILE_SIZE - offset) {
+		return -EFBIG;
+	}
+	if (flush_ino(ino) != 0) {
+		return -ENOMEM;
+	}
+	off_t end = offset + length;
+
+	if (mode & FALLOC_FL_PUNCH_HOLE) {
+		//Linux only punches holes that keep the size.
+		if (!(mode & FALLOC_FL_KEEP_SIZE)) {
+			return -EOPNOTSUPP;
+		}
+		if (offset >= entry_size[ino]) {
+			return 0;
+		}
+		if (end > entry_size[ino]) {
+			end = entry_size[ino];
+		}
+		if (punch_hole(ino, offset, end - offset) != 0) {
+			return -ENOMEM;
+		}
+		entries[ino].version++;
+		entry_mtime[ino] = time(NULL);
+		return 0;
+	}
+
+	if (!(mode & FALLOC_FL_KEEP_SIZE) && end > entry_size[ino]) {
+		if (resize_data(ino, end) != 0) {
+			return -ENOSPC;
+		}
+		entries[ino].version++;
+		entry_mtime[ino] = time(NULL);
+	}
+	//Inline files have all the room they need up to INLINE_MAX.
+	if (end <= INLINE_MAX && (entry_flags[ino] & ENTRY_INLINE)) {
+		return 0;
+	}
+	if ((entry_flags[ino] & ENTRY_INLINE) && inline_to_blocks(ino) != 0) {
+		return -ENOSPC;
+	}
+	entry_flags[ino] |= ENTRY_RESERVED;
+	if (reserve_range(ino, offset / BLOCK_SIZE, (end - 1) / BLOCK_SIZE) != 0) {
+		lfs_log(LOG_ERROR, LOG_DATA, "fallocate: out of memory", path, offset, length);
+		return -ENOSPC;
+	}
+	return 0;
+}
+
+//Copy size bytes from one file to another through a buffer. Both ranges
+//must be inside their files.
+static int copy_bytes(int in, off_t offset_in, int out, off_t offset_out, size_t size) {
+	char buf[BLOCK_SIZE];
+	while (size > 0) {
+		size_t n = size < BLOCK_SIZE ? size : BLOCK_SIZE;
+		if (read_data(in, buf, n, offset_in) != 0) {
+			return -EIO;
+		}
+		if (write_data(out, buf, n, offset_out) != 0) {
+			return -ENOMEM;
+		}
+		offset_in += n;
+		offset_out += n;
+		size -= n;
+	}
+	return 0;
+}
+
+//Copy between two ranges that start at the same place in a block. The
+//blocks the ranges cover in full are shared rather than copied, and holes
+//stay holes; a later write to either file copies the block it changes.
+static int share_blocks(int in, off_t offset_in, int out, off_t offset_out, size_t size) {
+	size_t head = (BLOCK_SIZE - offset_in % BLOCK_SIZE) % BLOCK_SIZE;
+	if (head > size) {
+		head = size;
+	}
+	if (copy_bytes(in, offset_in, out, offset_out, head) != 0) {
+		return -ENOMEM;
+	}
+	offset_in += head;
+	offset_out += head;
+	size -= head;
+
+	//A last part block is shared too when both ranges end their files, the
+	//rest of it is zero in both.
+	struct blockmap *src = &entries[in].map, *dst = &entries[out].map;
+	bool at_ends = offset_in + (off_t) size == entry_size[in] && offset_out + (off_t) size == entry_size[out];
+	uint64_t first = offset_in / BLOCK_SIZE, end = first + (size + (at_ends ? BLOCK_SIZE - 1 : 0)) / BLOCK_SIZE;
+	uint64_t shift = offset_out / BLOCK_SIZE - first;
+	for (uint64_t i = first; i < end; i++) {
+		struct block *b = blockmap_get(src, i);
+		if (b == NULL) {
+			uint64_t data = blockmap_next(src, i, end, true);
+			blockmap_clear(dst, i + shift, data + shift);
+			i = data - 1;
+			continue;
+		}
+		struct block **slot = blockmap_slot(dst, i + shift, true);
+		if (slot == NULL) {
+			return -ENOMEM;
+		}
+		block_get(b);
+		block_put(*slot);
+		*slot = b;
+	}
+	if (at_ends) {
+		return 0;
+	}
+	off_t done = (off_t) (end - first) * BLOCK_SIZE;
+	return copy_bytes(in, offset_in + done, out, offset_out + done, size % BLOCK_SIZE);
+}
+
+//Copy within the tree without the data passing through the kernel. Files
+//in blocks whose ranges line up share their blocks, others are copied a
+//block at a time.
+ssize_t lfs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t offset_in,
+		const char *path_out, struct fuse_file_info *fi_out, off_t offset_out, size_t size, int flags) {
+	lfs_log(LOG_TRACE, LOG_DATA, "copy_file_range (offset_in, size)", path_in, offset_in, size);
+
+	int in = fi_in ? get_handle(fi_in)->ino : get_entry(path_in);
+	int out = fi_out ? get_handle(fi_out)->ino : get_entry(path_out);
+	if (in < 0 || out < 0) {
+		return in < 0 ? in : out;
+	}
+	if (is_dir(in) || is_dir(out)) {
+		return -EISDIR;
+	}
+	if (flags != 0 || offset_in < 0 || offset_out < 0) {
+		return -EINVAL;
+	}
+	if (offset_in >= entry_size[in]) {
+		return 0;
+	}
+	if ((off_t) size > entry_size[in] - offset_in) {
+		size = entry_size[in] - offset_in;
+	}
+	if (in == out && offset_in < offset_out + (off_t) size && offset_out < offset_in + (off_t) size) {
+		return -EINVAL;
+	}
+	if ((off_t) size > MAX_FILE_SIZE - offset_out) {
+		return -EFBIG;
+	}
+
+	int err = flush_ino(in) || flush_ino(out) ? -ENOMEM : 0;
+	if (err == 0 && offset_out + (off_t) size > entry_size[out]) {
+		err = resize_data(out, offset_out + size);
+	}
+	if (err == 0) {
+		bool aligned = offset_in % BLOCK_SIZE == offset_out % BLOCK_SIZE &&
+			!(entry_flags[in] & ENTRY_INLINE) && !(entry_flags[out] & ENTRY_INLINE);
+		err = aligned ? share_blocks(in, offset_in, out, offset_out, size) :
+			copy_bytes(in, offset_in, out, offset_out, size);
+	}
+	if (err != 0) {
+		lfs_log(LOG_ERROR, LOG_DATA, "copy_file_range: out of memory", path_out, offset_out, size);
+		return -ENOMEM;
+	}
+
+	entry_atime[in] = time(NULL);
+	entry_atime[out] = time(NULL);
+	entry_mtime[out] = time(NULL);
+	entries[out].version++;
+	invalidate(path_out, LFS_INVAL_INODE);
+	return size;
+}
+
+//Called on every close of a file descriptor, so an error writing what the
+//handle holds reaches the program.
+int lfs_flush(const char *path, struct fuse_file_info *fi) {
+	lfs_log(LOG_TRACE, LOG_DATA, "flush", path, 0, 0);
+	return flush_own(get_handle(fi));
+}
+
+//The writes go into the tree, which reaches the disk with the next snapshot.
+int lfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	lfs_log(LOG_TRACE, LOG_DATA, "fsync", path, datasync, 0);
+	return flush_own(get_handle(fi));
+}
+
+int lfs_release(const char *path, struct fuse_file_info *fi) {
+	lfs_log(LOG_TRACE, LOG_DATA, "release", path, 0, 0);
+	struct handle *h = get_handle(fi);
+	int err = flush_own(h);
+	if (h->len > 0) {
+		lfs_log(LOG_ERROR, LOG_DATA, "release: writes lost", path, h->len, h->start);
+		drop_pending(h);
+	}
+	if (--entries[h->ino].opens == 0 && (entry_flags[h->ino] & ENTRY_UNLINKED)) {
+		release_entry(h->ino);
+	}
+	free(h);
+	return err;
+}
+
+int lfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	lfs_log(LOG_TRACE, LOG_DATA, "write (size, offset)", path, size, offset);
+
+	struct handle *h = get_handle(fi);
+	int ino = h->ino;
+	if ((off_t) size > MAX_FILE_SIZE - offset) {
+		return -EFBIG;
+	}
+
+	//Writes gathered by another handle, or by this one if this write does
+	//not continue them, go in first so that the last write wins.
+	struct handle *other = pending_handle(ino);
+	if (other && (other != h || offset != h->start + (off_t) h->len ||
+			h->len + size > h->cap) && flush_handle(other) != 0) {
+		lfs_log(LOG_ERROR, LOG_DATA, "write: out of memory", path, size, offset);
+		return -ENOMEM;
+	}
+
+	//Grow the file if the write goes past the end of the file.
+	//The writeback cache sends page sized writes at any offset.
+	if (offset + size > entry_size[ino] && resize_data(ino, offset + size) != 0) {
+		lfs_log(LOG_ERROR, LOG_DATA, "write: out of memory", path, size, offset);
+		return -ENOMEM;
+	}
+
+	//Only a write that continues the last one through the handle is
+	//gathered, others go straight into the file.
+	//A new buffer takes the size set now, one in use keeps its own.
+	size_t cap = h->len > 0 ? h->cap : (size_t) write_buffer << 10;
+	bool gather = offset == h->end && size < cap && !(entry_flags[ino] & ENTRY_INLINE) &&
+		(h->len > 0 || pending_count < write_buffers);
+	if (gather && h->len == 0 && (h->buf = malloc(cap)) != NULL) {
+		h->cap = cap;
+		h->start = offset;
+		h->next = pending;
+		pending = h;
+		pending_count++;
+		entry_flags[ino] |= ENTRY_PENDING;
+	}
+	if (gather && h->buf) {
+		memcpy(h->buf + h->len, buf, size);
+		h->len += size;
+	} else if (write_data(ino, buf, size, offset) != 0) {
+		lfs_log(LOG_ERROR, LOG_DATA, "write: out of memory", path, size, offset);
+		return -ENOMEM;
+	}
+	h->end = offset + size;
+
+	time_t now = time(NULL);
+	entry_atime[ino] = now;
+	entry_mtime[ino] = now;
+	entries[ino].version++;
+	
+	return size;
+}
+
+int lfs_truncate(const char* path, off_t size, struct fuse_file_info *fi) {
+	lfs_log(LOG_TRACE, LOG_DATA, "truncate (size)", path, size, 0);
+
+	int ino = get_entry(path);
+	if (ino < 0) {
+		lfs_log(LOG_DEBUG, LOG_DATA, "truncate failed", path, ino, 0);
+		return ino;
+	}
+
+	if (is_dir(ino)) {
+		lfs_log(LOG_DEBUG, LOG_DATA, "truncate failed", path, -EISDIR, 0);
+		return -EISDIR;
+	}
+
+	if (size < 0) {
+		return -EINVAL;
+	}
+	if (size > MAX_FILE_SIZE) {
+		return -EFBIG;
+	}
+
+	//Zero filled past the old end of file
+	if (flush_ino(ino) != 0 || resize_data(ino, size) != 0) {
+		lfs_log(LOG_ERROR, LOG_DATA, "truncate: out of memory", path, size, 0);
+		return -ENOMEM;
+	}
+	entries[ino].version++;
+	entry_mtime[ino] = time(NULL);
+	entry_atime[ino] = time(NULL);	
+	return 0;
+
+}
+
+int lfs_mkdir(const char *path, mode_t mode) {
+	lfs_log(LOG_TRACE, LOG_META, "mkdir", path, mode, 0);
+	int ino = new_entry(path, true);
+	if (ino < 0) {
+		lfs_log(LOG_DEBUG, LOG_META, "mkdir failed", path, ino, 0);
+		return ino;
+	}
+	invalidate_name(path);
+	return 0;
+}
+
+//Delete a directory
+int lfs_rmdir(const char *path) {
+	lfs_log(LOG_TRACE, LOG_META, "rmdir", path, 0, 0);
+	int ino = get_entry(path);
+	if (ino < 0) {
+		lfs_log(LOG_DEBUG, LOG_META, "rmdir failed", path, ino, 0);
+		return ino;
+	}
+	if (!is_dir(ino)) {
+		lfs_log(LOG_DEBUG, LOG_META, "rmdir failed", path, -ENOTDIR, 0);
+		return -ENOTDIR;
+	}
+	if (ino == 0) {
+		return -EBUSY;
+	}
+	if (dirtree_count(entries[ino].children) > 0) {
+		lfs_log(LOG_DEBUG, LOG_META, "rmdir failed", path, -ENOTEMPTY, 0);
+		return -ENOTEMPTY;
+	}
+	//Delete entry
+	free_entry(ino);
+	invalidate_name(path);
+	return 0;
+}
+
+//A time utimensat sets: old on UTIME_OMIT, now on UTIME_NOW.
+static time_t utime_value(const struct timespec *tv, time_t old, time_t now) {
+	if (tv->tv_nsec == UTIME_OMIT) {
+		return old;
+	}
+	return tv->tv_nsec == UTIME_NOW ? now : tv->tv_sec;
+}
+
+int lfs_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi) {
+	lfs_log(LOG_TRACE, LOG_META, "utimens", path, tv[0].tv_sec, tv[1].tv_sec);
+	int ino = get_entry(path);
+	if (ino < 0) {
+		lfs_log(LOG_DEBUG, LOG_META, "utimens failed", path, ino, 0);
+		return ino;
+	}
+	//Update access and modification time
+	//The writeback cache owns mtime and pushes it back to us here, on its
+	//own with atime UTIME_OMIT.
+	time_t now = time(NULL);
+	entry_atime[ino] = utime_value(&tv[0], entry_atime[ino], now);
+	entry_mtime[ino] = utime_value(&tv[1], entry_mtime[ino], now);
+	return 0;
+}
+
+//Usage is the blocks in memory, a block shared by several files counts once.
+int lfs_statfs(const char *path, struct statvfs *st) {
+	lfs_log(LOG_TRACE, LOG_META, "statfs", path, 0, 0);
+	struct block_stats blocks;
+	block_get_stats(&blocks);
+	unsigned long used = blocks.blocks;
+	unsigned long avail = sysconf(_SC_AVPHYS_PAGES) * (unsigned long) sysconf(_SC_PAGESIZE) / BLOCK_SIZE;
+
+	memset(st, 0, sizeof(struct statvfs));
+	st->f_bsize = BLOCK_SIZE;
+	st->f_frsize = BLOCK_SIZE;
+	st->f_blocks = used + avail;
+	st->f_bfree = avail;
+	st->f_bavail = avail;
+	st->f_files = entries_count + 1;
+	st->f_ffree = INT_MAX - entries_count;
+	st->f_favail = st->f_ffree;
+	st->f_namemax = NAME_MAX;
+	return 0;
+}
+
+static int path_depth(const char *path) {
+	int depth = 0;
+	for (; *path; path++) {
+		depth += *path == '/';
+	}
+	return depth;
+}
+
+static char **load_paths;
+
+// Blocks loaded so far, by their number in the image.
+static struct block **load_blocks;
+static uint32_t load_nblocks;
+static uint32_t load_blocks_cap;
+
+static int compare_depth(const void *a, const void *b) {
+	return path_depth(load_paths[*(int*) a]) - path_depth(load_paths[*(int*) b]);
+}
+
+//Read the blocks of a file of size bytes, see write_blocks. Version 1
+//images hold the bytes of every file in full.
+//Returns 0, -EIO for a short or damaged image or -ENOMEM.
+static int read_blocks(FILE *fp, uint32_t version, struct entry *e, off_t size) {
+	uint64_t nblocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	for (uint64_t i = 0; i < nblocks; i++) {
+		uint32_t id;
+		if (version == 1) {
+			struct block *b = block_new();
+			struct block **slot = b ? blockmap_slot(&e->map, i, true) : NULL;
+			if (slot == NULL) {
+				block_put(b);
+				return -ENOMEM;
+			}
+			size_t n = size - i * BLOCK_SIZE < BLOCK_SIZE ? size - i * BLOCK_SIZE : BLOCK_SIZE;
+			if (fread(b->data, sizeof(char), n, fp) != n) {
+				block_put(b);
+				return -EIO;
+			}
+			*slot = block_dedup(b);
+			continue;
+		}
+		if (fread(&id, sizeof(uint32_t), 1, fp) != 1 || (id > load_nblocks && id != IMAGE_HOLE)) {
+			return -EIO;
+		}
+		if (id == IMAGE_HOLE) {
+			uint32_t run;
+			if (fread(&run, sizeof(uint32_t), 1, fp) != 1 || run == 0 || run > nblocks - i) {
+				return -EIO;
+			}
+			i += run - 1;
+			continue;
+		}
+		struct block **slot = blockmap_slot(&e->map, i, true);
+		if (slot == NULL) {
+			return -ENOMEM;
+		}
+		if (id < load_nblocks) {
+			block_get(load_blocks[id]);
+			*slot = load_blocks[id];
+			continue;
+		}
+
+		if (load_nblocks == load_blocks_cap) {
+			uint32_t cap = load_blocks_cap ? load_blocks_cap * 2 : 1024;
+			struct block **grown = realloc(load_blocks, cap * sizeof(struct block *));
+			if (grown == NULL) {
+				return -ENOMEM;
+			}
+			load_blocks = grown;
+			load_blocks_cap = cap;
+		}
+		struct block *b = block_new();
+		if (b == NULL) {
+			return -ENOMEM;
+		}
+		uint16_t len;
+		long offset = ftell(fp);
+		if (fread(&len, sizeof(uint16_t), 1, fp) != 1 || len > BLOCK_SIZE ||
+				fread(b->data, sizeof(char), len, fp) != len) {
+			block_put(b);
+			return -EIO;
+		}
+		block_saved(b, image_gen, offset);
+		b = block_dedup(b);
+		load_blocks[load_nblocks++] = b;
+		*slot = b;
+	}
+	return 0;
+}
+
+int read_entries_from_file(FILE *fp) {
+	uint64_t start = stats_now();
+	uint32_t version = 1;
+	int count;
+	int i;
+	image_gen++;
+
+	//Read the numbers of entries from the file
+	if (fread(&count, sizeof(int), 1, fp) != 1) {
+		count = -1;
+	}
+	if (count == IMAGE_MAGIC) {
+		if (fread(&version, sizeof(uint32_t), 1, fp) != 1 || version < 2 || version > IMAGE_VERSION) {
+			lfs_log(LOG_ERROR, LOG_PERSIST, "unknown image version", NULL, version, 0);
+			fclose(fp);
+			return -EIO;
+		}
+		if (fread(&count, sizeof(int), 1, fp) != 1) {
+			count = -1;
+		}
+	}
+	lfs_log(LOG_INFO, LOG_PERSIST, "reading entries", NULL, count, 0);
+
+	if(count < 0) {
+		lfs_log(LOG_ERROR, LOG_PERSIST, "invalid number of entries", NULL, count, 0);
+		fclose(fp);
+		return -EIO;
+	}
+
+	//Paths are only needed until every entry is linked into its parent.
+	load_paths = calloc(count + 1, sizeof(char*));
+	int *order = calloc(count + 1, sizeof(int));
+	int *inos = calloc(count + 1, sizeof(int));
+	if (!load_paths || !order || !inos) {
+		lfs_log(LOG_ERROR, LOG_PERSIST, "read: out of memory", NULL, count, 0);
+		fclose(fp);
+		free(load_paths);
+		free(order);
+		free(inos);
+		return -ENOMEM;
+	}
+	int err = -EIO;
+
+	//Read the entries from the file
+	for (i = 0; i < count; i++) {
+		size_t size;
+		int ino = find_empty_entry();
+		if (ino == -1) {
+			err = -ENOMEM;
+			goto fail;
+		}
+		struct entry *e = &entries[ino];
+		memset(e, 0, sizeof(struct entry));
+		e->version = 1;
+		inos[i] = ino;
+		order[i] = i;
+
+		//Read full_path
+		if (fread(&size, sizeof(size_t), 1, fp) != 1 || size == 0 || size >= PATH_MAX) {
+			goto truncated;
+		}
+		load_paths[i] = calloc(sizeof(char), size + 1);
+		if(!load_paths[i]){
+			err = -ENOMEM;
+			goto fail;
+		}
+
+		if (fread(load_paths[i], size, 1, fp) != 1) {
+			goto truncated;
+		}
+		lfs_log(LOG_DEBUG, LOG_PERSIST, "read entry", load_paths[i], ino, 0);
+
+		e->name = get_entry_name(load_paths[i]);
+
+		bool dir;
+		if (fread(&dir, sizeof(bool), 1, fp) != 1 ||
+				fread(&entry_atime[ino], sizeof(time_t), 1, fp) != 1 ||
+				fread(&entry_mtime[ino], sizeof(time_t), 1, fp) != 1) {
+			goto truncated;
+		}
+		entry_flags[ino] = ENTRY_USED | (dir ? ENTRY_DIR : 0);
+
+		if (dir) {
+			e->children = dirtree_new();
+			if (!e->children) {
+				err = -ENOMEM;
+				goto fail;
+			}
+		}
+
+		if (!dir) {
+			//Sizes are 64 bit since version 5.
+			int64_t file_size;
+			int small_size;
+			if (version >= 5 ? fread(&file_size, sizeof(int64_t), 1, fp) != 1 :
+					fread(&small_size, sizeof(int), 1, fp) != 1) {
+				goto truncated;
+			}
+			if (version < 5) {
+				file_size = small_size;
+			}
+			if (file_size < 0 || file_size > MAX_FILE_SIZE) {
+				goto truncated;
+			}
+			//Small files are stored as they are since version 3.
+			if (version >= 3 && file_size <= INLINE_MAX) {
+				entry_flags[ino] |= ENTRY_INLINE;
+				if (fread(e->data, sizeof(char), file_size, fp) != (size_t) file_size) {
+					goto truncated;
+				}
+			} else {
+				int res = read_blocks(fp, version, e, file_size);
+				if (res == -ENOMEM) {
+					err = res;
+					goto fail;
+				}
+				if (res) {
+					goto truncated;
+				}
+				if (file_size <= INLINE_MAX) {
+					blocks_to_inline(ino, file_size);
+				}
+			}
+			entry_size[ino] = file_size;
+		}
+	}
+	long image_bytes = ftell(fp);
+	//Evicted blocks are read back from this image until the next save.
+	block_set_image(dup(fileno(fp)), image_gen);
+	fclose(fp);
+	free(load_blocks);
+	load_blocks = NULL;
+	load_nblocks = load_blocks_cap = 0;
+
+	//Link parents before their children, the image is in inode order.
+	qsort(order, count, sizeof(int), compare_depth);
+	for (i = 0; i < count; i++) {
+		int ino = inos[order[i]];
+		char *parent_path = get_parent_path(load_paths[order[i]]);
+		int parent = get_entry(parent_path);
+		pool_free_str(parent_path);
+		if (parent < 0 || !is_dir(parent) ||
+				dirtree_insert(entries[parent].children, entries[ino].name, (void*) (intptr_t) ino) != 0) {
+			lfs_log(LOG_ERROR, LOG_PERSIST, "could not link entry", load_paths[order[i]], ino, parent);
+			release_entry(ino);
+			continue;
+		}
+		entries[ino].parent = parent;
+		entries_count++;
+	}
+
+	for (i = 0; i < count; i++) {
+		free(load_paths[i]);
+	}
+	free(load_paths);
+	free(order);
+	free(inos);
+	stats_record(STAT_IMAGE_LOAD, start, image_bytes);
+	return 0;
+
+truncated:
+	lfs_log(LOG_ERROR, LOG_PERSIST, "image is truncated or damaged at entry", NULL, i, ftell(fp));
+fail:
+	//A failed load must not leave half an entry table behind.
+	if (err == -ENOMEM) {
+		lfs_log(LOG_ERROR, LOG_PERSIST, "read: out of memory", NULL, i, 0);
+	}
+	fclose(fp);
+	for (int j = 0; j <= i && j < count; j++) {
+		if (inos[j]) {
+			release_entry(inos[j]);
+		}
+		free(load_paths[j]);
+	}
+	free(load_paths);
+	free(order);
+	free(inos);
+	free(load_blocks);
+	load_blocks = NULL;
+	load_nblocks = load_blocks_cap = 0;
+	return err;
+}
+
+//Write the blocks of a file. Every distinct block goes into the image once:
+//a block is written as its number, and where a number first appears it is
+//followed by the length of the block without its trailing zeros and those
+//bytes. A run of holes is IMAGE_HOLE and the number of holes. Blocks not
+//yet in the index are added so equal ones are found.
+//Returns 0 or -EIO if an evicted block could not be read back.
+static int write_blocks(FILE *fp, struct entry *e, off_t size, uint32_t *next_id) {
+	uint32_t hole = IMAGE_HOLE;
+	uint64_t nblocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	for (uint64_t i = 0; i < nblocks; i++) {
+		struct block *b = blockmap_get(&e->map, i);
+		if (b == NULL) {
+			uint64_t end = blockmap_next(&e->map, i, nblocks, true);
+			while (i < end) {
+				uint32_t run = end - i < UINT32_MAX ? end - i : UINT32_MAX;
+				fwrite(&hole, sizeof(uint32_t), 1, fp);
+				fwrite(&run, sizeof(uint32_t), 1, fp);
+				i += run;
+			}
+			i--;
+			continue;
+		}
+		struct block *found = block_find(b);
+		if (found->image_gen == image_gen) {
+			fwrite(&found->image_id, sizeof(uint32_t), 1, fp);
+		} else {
+			//An evicted block stays evicted, it is found in the new image.
+			const char *data = block_peek(found, read_scratch);
+			if (data == NULL) {
+				return -EIO;
+			}
+			found->image_id = (*next_id)++;
+			uint16_t len = BLOCK_SIZE;
+			while (len > 0 && data[len - 1] == 0) {
+				len--;
+			}
+			fwrite(&found->image_id, sizeof(uint32_t), 1, fp);
+			block_saved(found, image_gen, ftell(fp));
+			fwrite(&len, sizeof(uint16_t), 1, fp);
+			fwrite(data, sizeof(char), len, fp);
+		}
+		//A copy the index does not hold is read back from the one written,
+		//so it can be evicted too.
+		if (found != b && b->image_gen != image_gen) {
+			block_saved(b, image_gen, found->image_offset);
+		}
+	}
+	return 0;
+}
+
+//Method that writes the entries to the file
+int write_entries_to_file(FILE *fp, bool running) {
+	lfs_log(LOG_INFO, LOG_PERSIST, "writing entries", NULL, entries_count, running);
+	uint64_t start = stats_now();
+	char path[PATH_MAX];
+	int32_t magic = IMAGE_MAGIC;
+	uint32_t version = IMAGE_VERSION;
+	uint32_t next_id = 0;
+	int err = 0;
+	image_gen++;
+	fwrite(&magic, sizeof(int32_t), 1, fp);
+	fwrite(&version, sizeof(uint32_t), 1, fp);
+	fwrite(&entries_count, sizeof(int), 1, fp);
+
+	for (int i = 1; i < entries_size && err == 0; i++) {
+		if ((entry_flags[i] & (ENTRY_USED | ENTRY_UNLINKED)) != ENTRY_USED) {
+			continue;
+		}
+
+		size_t size = entry_path(i, path, sizeof(path));
+		fwrite(&size, sizeof(size_t), 1, fp);
+		fwrite(path, sizeof(char), size, fp);
+
+		bool dir = is_dir(i);
+		fwrite(&dir, sizeof(bool), 1, fp);
+		fwrite(&entry_atime[i], sizeof(time_t), 1, fp);
+		fwrite(&entry_mtime[i], sizeof(time_t), 1, fp);
+
+		if(!dir) {
+			int64_t file_size = entry_size[i];
+			fwrite(&file_size, sizeof(int64_t), 1, fp);
+			//Blocks fallocate reserved past the end are not saved, so a
+			//small file can have blocks.
+			if (entry_size[i] <= INLINE_MAX) {
+				char data[INLINE_MAX];
+				err = read_data(i, data, entry_size[i], 0);
+				fwrite(data, sizeof(char), entry_size[i], fp);
+			} else {
+				err = write_blocks(fp, &entries[i], entry_size[i], &next_id);
+			}
+		}
+	}
+	if (!running) {
+		for (int i = entries_size - 1; i >= 0; i--) {
+			if (entry_flags[i] & ENTRY_USED) {
+				release_entry(i);
+			}
+		}
+		entries_count = 0;
+	}
+	long image_bytes = ftell(fp);
+	int failed = ferror(fp) || err;
+	if (fclose(fp) != 0 || failed) {
+		lfs_log(LOG_ERROR, LOG_PERSIST, "could not write image", NULL, errno, image_bytes);
+		return -EIO;
+	}
+	stats_record(STAT_IMAGE_SAVE, start, image_bytes);
+	return 0;
+}
+
+static int posix_open(const char *path, int flags, mode_t mode) {
+	return open(path, flags, mode);
+}
+
+struct image_io image_io = {
+	.open = posix_open,
+	.write = write,
+	.fsync = fsync,
+	.close = close,
+	.rename = rename,
+};
+
+// An image being written, the stdio stream on top of it counts the bytes.
+struct image_file {
+	int fd;
+	off64_t pos;
+};
+
+static ssize_t image_write(void *cookie, const char *buf, size_t size) {
+	struct image_file *file = cookie;
+	size_t done = 0;
+	while (done < size) {
+		ssize_t n = image_io.write(file->fd, buf + done, size - done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return done ? (ssize_t) done : -1;
+		}
+		done += n;
+	}
+	file->pos += done;
+	return done;
+}
+
+//Only there so ftell works.
+static int image_seek(void *cookie, off64_t *offset, int whence) {
+	struct image_file *file = cookie;
+	if (whence != SEEK_CUR || *offset != 0) {
+		errno = ESPIPE;
+		return -1;
+	}
+	*offset = file->pos;
+	return 0;
+}
+
+static const cookie_io_functions_t image_funcs = {
+	.write = image_write,
+	.seek = image_seek,
+};
+
+//Make a rename in the directory of path durable.
+static int sync_dir(const char *path) {
+	char dir[PATH_MAX];
+	const char *slash = strrchr(path, '/');
+	if (slash == NULL) {
+		strcpy(dir, ".");
+	} else if (slash == path) {
+		strcpy(dir, "/");
+	} else {
+		snprintf(dir, sizeof(dir), "%.*s", (int) (slash - path), path);
+	}
+
+	int fd = image_io.open(dir, O_RDONLY | O_DIRECTORY, 0);
+	if (fd < 0) {
+		return -errno;
+	}
+	//Some filesystems cannot sync a directory, they have nothing to do.
+	int err = image_io.fsync(fd) != 0 && errno != EINVAL ? -errno : 0;
+	image_io.close(fd);
+	return err;
+}
+
+int store_image(const char *path, bool running) {
+	char tmp[PATH_MAX];
+	struct image_file file = { .pos = 0 };
+	int err = 0;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+		return -ENAMETOOLONG;
+	}
+	file.fd = image_io.open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (file.fd < 0) {
+		err = -errno;
+		lfs_log(LOG_ERROR, LOG_PERSIST, "could not create image", tmp, err, 0);
+		return err;
+	}
+	FILE *fp = fopencookie(&file, "w", image_funcs);
+	if (fp == NULL) {
+		image_io.close(file.fd);
+		return -ENOMEM;
+	}
+
+	//Only a complete, synced image replaces the old one.
+	err = write_entries_to_file(fp, running);
+	if (err == 0 && image_io.fsync(file.fd) != 0) {
+		err = -errno;
+	}
+	image_io.close(file.fd);
+	if (err == 0 && image_io.rename(tmp, path) != 0) {
+		err = -errno;
+	}
+	if (err == 0) {
+		err = sync_dir(path);
+	}
+	if (err) {
+		lfs_log(LOG_ERROR, LOG_PERSIST, "could not store image", path, err, 0);
+		return err;
+	}
+	//Evicted blocks are read back from the new image from now on. If it
+	//cannot be opened the old one is kept, whose file is still open.
+	int fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		block_set_image(fd, image_gen);
+	}
+	return 0;
+}
+
@@ -0,0 +1,130 @@
+#ifndef CORE_H
+#define CORE_H
+
+#include <fuse.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+
+#include "block.h"
+
+// The filesystem itself: the entry table, file data and the image format.
+//
+// The lfs_ calls take the same arguments as the fuse callbacks of the same
+// name and return 0, a byte count or -errno. They do no locking and never
+// talk to the kernel, so they can be driven from any program; lfs.c adds the
+// locking, stats and control files around them for the mount.
+
+
+// Set up the pools and an empty tree with only the root.
+int core_init(void);
+
+int lfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi);
+int lfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags);
+int lfs_open(const char *path, struct fuse_file_info *fi);
+int lfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int lfs_flush(const char *path, struct fuse_file_info *fi);
+int lfs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+int lfs_release(const char *path, struct fuse_file_info *fi);
+off_t lfs_lseek(const char *path, off_t offset, int whence, struct fuse_file_info *fi);
+int lfs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi);
+ssize_t lfs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t offset_in,
+	const char *path_out, struct fuse_file_info *fi_out, off_t offset_out, size_t size, int flags);
+int lfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int lfs_mkdir(const char *path, mode_t mode);
+int lfs_rmdir(const char *path);
+int lfs_mknod(const char *path, mode_t mode, dev_t dev);
+int lfs_unlink(const char *path);
+int lfs_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi);
+int lfs_truncate(const char *path, off_t size, struct fuse_file_info *fi);
+int lfs_statfs(const char *path, struct statvfs *st);
+
+// Walk path from the root. Returns the inode, 0 for "/", or -ENOENT / -ENOTDIR.
+int get_entry(const char *path);
+
+// The directory part of path with its trailing slash, a pool string.
+char *get_parent_path(const char *path);
+
+// Make the next open of ino drop what the kernel has cached of its data.
+void mark_changed(int ino);
+
+// What to drop from the kernel caches for a path.
+#define LFS_INVAL_INODE 1	// attributes and page cache
+#define LFS_INVAL_ENTRY 2	// the name in its parent directory
+
+// Queue an invalidation of path for the kernel, defined by the mount.
+void lfs_invalidate(const char *path, int what);
+
+// Called with the paths an op changes behind the kernel's back and what of
+// them it may have cached: names added and removed and the destination of a
+// copy. Data and attributes the kernel wrote itself are not invalidated, so
+// its page cache and attributes survive. The mount points it at lfs_invalidate; NULL when nothing caches
+// the tree, as in the benchmarks and the replay engine.
+extern void (*lfs_invalidate_hook)(const char *path, int what);
+
+// Where a compression pass is, start it zeroed.
+struct compress_cursor {
+	int ino;
+	uint64_t block;
+};
+
+// Do part of a pass that moves file data between memory tiers: blocks of
+// files not accessed since cutoff are compressed, compressed blocks of files
+// accessed since then are expanded. Stops after about budget blocks and
+// entries; returns true when the pass is done, the cursor is then zeroed.
+bool compress_step(time_t cutoff, struct compress_cursor *cur, int budget);
+
+// Where the evictor's clock hand is, start it zeroed.
+struct evict_cursor {
+	int ino;
+	uint64_t block;
+	int sweep;
+};
+
+// Evict blocks that are in the image until block data takes at most limit
+// bytes. Blocks read or written since the hand last passed them get a
+// second chance, and the first sweep round the files only takes blocks of
+// files not accessed since cutoff. Stops after about budget blocks and
+// entries; returns 1 once under the limit, 0 if there is more to do and -1
+// after two sweeps that could not get there.
+int evict_step(size_t limit, time_t cutoff, struct evict_cursor *cur, int budget);
+
+// Small writes through an open file are gathered in a buffer of
+// write_buffer KiB, 0 turns that off. At most write_buffers open files hold
+// one at a time, so open files cannot pin much memory. Both can be changed
+// while mounted; a buffer in use keeps the size it was made with.
+#define DEFAULT_WRITE_BUFFER 64
+#define DEFAULT_WRITE_BUFFERS 256
+extern int write_buffer;
+extern int write_buffers;
+
+// Put the small writes that open files are still gathering into the tree.
+// Returns 0 or -ENOMEM if some could not be written.
+int flush_handles(void);
+
+// Load an image into the tree, or write the tree to one. Both close fp.
+// Unless running, writing also frees the whole tree. Writes open files are
+// still gathering are not in the image, see flush_handles.
+int read_entries_from_file(FILE *fp);
+int write_entries_to_file(FILE *fp, bool running);
+
+// Save the tree to path so that a crash at any point leaves either the old
+// or the new image there: the image is written to path.tmp, synced, renamed
+// over path and the directory synced. Unless running, the tree is freed.
+int store_image(const char *path, bool running);
+
+// The calls store_image makes to the system. A test can swap them to record
+// or fail what the image code does.
+struct image_io {
+	int (*open)(const char *path, int flags, mode_t mode);
+	ssize_t (*write)(int fd, const void *buf, size_t size);
+	int (*fsync)(int fd);
+	int (*close)(int fd);
+	int (*rename)(const char *from, const char *to);
+};
+
+extern struct image_io image_io;
+
+#endif
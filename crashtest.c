@@ -0,0 +1,486 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "core.h"
+
+// Crash consistency check of the image code, run on the core without a mount.
+//
+//     ./crashtest [-r variants] [-s seed] [-o image] [-S]
+//
+// It saves a tree (state A) and then a changed tree (state B) through a
+// store_image whose system calls are recorded instead of done. Then, for
+// every point in the recorded calls of the second save, it rebuilds the
+// files a crash there could leave behind and loads the image from them.
+// Writes not yet synced at the crash are applied in full, not at all, and
+// in -r random mixes where each is kept or lost, applied out of order or
+// torn at a sector boundary. Renames not yet made durable by a directory
+// sync are both kept and lost. Every load has to succeed and give exactly
+// state A or state B.
+//
+// -S turns every fsync into a no-op, which should make the check fail; it
+// shows the check can see damage.
+
+#define SECTOR 512
+
+enum op_type {
+	OP_CREATE,	// open with O_TRUNC: new, empty contents
+	OP_WRITE,
+	OP_FSYNC,
+	OP_RENAME,
+	OP_DIRSYNC,
+};
+
+struct op {
+	enum op_type type;
+	int name;
+	int to;
+	off_t offset;
+	size_t size;
+	char *data;
+};
+
+// Names seen by the recorder, and the open files.
+#define MAX_NAMES 16
+#define MAX_FDS 16
+#define DIR_FD 1000
+#define FIRST_FD 100
+
+static char *names[MAX_NAMES];
+static int nnames;
+static struct {
+	int name;
+	off_t pos;
+} fds[MAX_FDS];
+
+static struct op *ops;
+static int nops;
+static int ops_cap;
+static bool no_fsync;
+
+static int variants = 8;
+static unsigned int seed = 1;
+static const char *image = "/tmp/crashtest.img";
+
+static struct op *add_op(enum op_type type) {
+	if (nops == ops_cap) {
+		ops_cap = ops_cap ? ops_cap * 2 : 256;
+		ops = realloc(ops, ops_cap * sizeof(struct op));
+		if (ops == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	struct op *op = &ops[nops++];
+	memset(op, 0, sizeof(struct op));
+	op->type = type;
+	return op;
+}
+
+static int name_index(const char *path) {
+	for (int i = 0; i < nnames; i++) {
+		if (strcmp(names[i], path) == 0) {
+			return i;
+		}
+	}
+	if (nnames == MAX_NAMES) {
+		fprintf(stderr, "too many files\n");
+		exit(1);
+	}
+	names[nnames] = strdup(path);
+	return nnames++;
+}
+
+static int rec_open(const char *path, int flags, mode_t mode) {
+	if (flags & O_DIRECTORY) {
+		return DIR_FD;
+	}
+	for (int fd = 0; fd < MAX_FDS; fd++) {
+		if (fds[fd].name < 0) {
+			fds[fd].name = name_index(path);
+			fds[fd].pos = 0;
+			if (flags & O_TRUNC) {
+				add_op(OP_CREATE)->name = fds[fd].name;
+			}
+			return FIRST_FD + fd;
+		}
+	}
+	errno = EMFILE;
+	return -1;
+}
+
+static ssize_t rec_write(int fd, const void *buf, size_t size) {
+	struct op *op = add_op(OP_WRITE);
+	op->name = fds[fd - FIRST_FD].name;
+	op->offset = fds[fd - FIRST_FD].pos;
+	op->size = size;
+	op->data = malloc(size);
+	memcpy(op->data, buf, size);
+	fds[fd - FIRST_FD].pos += size;
+	return size;
+}
+
+static int rec_fsync(int fd) {
+	if (no_fsync) {
+		return 0;
+	}
+	if (fd == DIR_FD) {
+		add_op(OP_DIRSYNC);
+	} else {
+		add_op(OP_FSYNC)->name = fds[fd - FIRST_FD].name;
+	}
+	return 0;
+}
+
+static int rec_close(int fd) {
+	if (fd != DIR_FD) {
+		fds[fd - FIRST_FD].name = -1;
+	}
+	return 0;
+}
+
+static int rec_rename(const char *from, const char *to) {
+	struct op *op = add_op(OP_RENAME);
+	op->name = name_index(from);
+	op->to = name_index(to);
+	return 0;
+}
+
+// What is on disk after a crash: names point at inodes, an inode has the
+// contents that are synced and the writes that are not yet.
+#define MAX_INODES 64
+
+struct inode {
+	char *data;
+	size_t size;
+	int pending[4096];
+	int npending;
+};
+
+static struct inode inodes[MAX_INODES];
+static int ninodes;
+
+static void put(struct inode *ino, off_t offset, const char *data, size_t size) {
+	if (offset + size > ino->size) {
+		ino->data = realloc(ino->data, offset + size);
+		memset(ino->data + ino->size, 0, offset + size - ino->size);
+		ino->size = offset + size;
+	}
+	memcpy(ino->data + offset, data, size);
+}
+
+static void reset_disk(void) {
+	for (int i = 0; i < ninodes; i++) {
+		free(inodes[i].data);
+	}
+	memset(inodes, 0, sizeof(inodes));
+	ninodes = 0;
+}
+
+//Contents of the image after a crash before op crash. variant 0 keeps all
+//unsynced writes, 1 none, the others a random mix. base_ops ops that came
+//before are applied in full first. Returns the size or -1 if there is no image.
+static ssize_t crash_image(int base_ops, int crash, int variant, char **out) {
+	int name_ino[MAX_NAMES], durable_ino[MAX_NAMES];
+	unsigned int r = seed * 7919 + crash * 104729 + variant;
+
+	reset_disk();
+	for (int i = 0; i < MAX_NAMES; i++) {
+		name_ino[i] = durable_ino[i] = -1;
+	}
+
+	for (int i = 0; i < crash; i++) {
+		struct op *op = &ops[i];
+		struct inode *ino = name_ino[op->name] >= 0 ? &inodes[name_ino[op->name]] : NULL;
+		switch (op->type) {
+		case OP_CREATE:
+			if (ino == NULL) {
+				name_ino[op->name] = ninodes++;
+				ino = &inodes[name_ino[op->name]];
+			}
+			ino->size = 0;
+			ino->npending = 0;
+			break;
+		case OP_WRITE:
+			if (i < base_ops) {
+				put(ino, op->offset, op->data, op->size);
+			} else {
+				ino->pending[ino->npending++] = i;
+			}
+			break;
+		case OP_FSYNC:
+			for (int p = 0; p < ino->npending; p++) {
+				struct op *w = &ops[ino->pending[p]];
+				put(ino, w->offset, w->data, w->size);
+			}
+			ino->npending = 0;
+			break;
+		case OP_RENAME:
+			name_ino[op->to] = name_ino[op->name];
+			name_ino[op->name] = -1;
+			if (i < base_ops) {
+				memcpy(durable_ino, name_ino, sizeof(name_ino));
+			}
+			break;
+		case OP_DIRSYNC:
+			memcpy(durable_ino, name_ino, sizeof(name_ino));
+			break;
+		}
+		if (i == base_ops - 1) {
+			memcpy(durable_ino, name_ino, sizeof(name_ino));
+		}
+	}
+
+	//Writes that were not synced, in the order picked by the variant.
+	for (int n = 0; n < ninodes; n++) {
+		struct inode *ino = &inodes[n];
+		if (variant >= 2) {
+			for (int p = ino->npending - 1; p > 0; p--) {
+				int q = rand_r(&r) % (p + 1);
+				int t = ino->pending[p];
+				ino->pending[p] = ino->pending[q];
+				ino->pending[q] = t;
+			}
+		}
+		for (int p = 0; p < ino->npending && variant != 1; p++) {
+			struct op *w = &ops[ino->pending[p]];
+			size_t size = w->size;
+			if (variant >= 2) {
+				int pick = rand_r(&r) % 4;
+				if (pick == 0) {
+					continue;
+				}
+				if (pick == 1) {
+					size = (rand_r(&r) % (size / SECTOR + 1)) * SECTOR;
+				}
+			}
+			put(ino, w->offset, w->data, size < w->size ? size : w->size);
+		}
+	}
+
+	//Renames since the last directory sync may or may not have made it.
+	int *final = variant % 2 ? durable_ino : name_ino;
+	int image_name = name_index(image);
+	if (final[image_name] < 0) {
+		return -1;
+	}
+	struct inode *ino = &inodes[final[image_name]];
+	*out = ino->data;
+	return ino->size;
+}
+
+static uint64_t mix(uint64_t h, const void *data, size_t size) {
+	const unsigned char *p = data;
+	for (size_t i = 0; i < size; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+struct names {
+	char **name;
+	int n;
+	int cap;
+};
+
+static int collect(void *buf, const char *name, const struct stat *st, off_t off, enum fuse_fill_dir_flags flags) {
+	struct names *list = buf;
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+		return 0;
+	}
+	if (list->n == list->cap) {
+		list->cap = list->cap ? list->cap * 2 : 64;
+		list->name = realloc(list->name, list->cap * sizeof(char *));
+	}
+	list->name[list->n++] = strdup(name);
+	return 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char **) a, *(char **) b);
+}
+
+//Hash of every path, type, size and file contents under dir, in name order.
+static uint64_t digest(const char *dir, uint64_t h) {
+	struct names list = { 0 };
+	char path[4096];
+	struct stat st;
+
+	if (lfs_readdir(dir, &list, collect, 0, NULL, 0) != 0) {
+		return 0;
+	}
+	qsort(list.name, list.n, sizeof(char *), compare_names);
+	for (int i = 0; i < list.n; i++) {
+		snprintf(path, sizeof(path), "%s/%s", strcmp(dir, "/") ? dir : "", list.name[i]);
+		if (lfs_getattr(path, &st, NULL) != 0) {
+			return 0;
+		}
+		h = mix(h, path, strlen(path) + 1);
+		h = mix(h, &st.st_mode, sizeof(st.st_mode));
+		h = mix(h, &st.st_size, sizeof(st.st_size));
+		if (S_ISDIR(st.st_mode)) {
+			h = digest(path, h);
+		} else if (st.st_size > 0) {
+			struct fuse_file_info fi = { 0 };
+			char *data = malloc(st.st_size);
+			if (lfs_open(path, &fi) != 0 || lfs_read(path, data, st.st_size, 0, &fi) != st.st_size) {
+				return 0;
+			}
+			lfs_release(path, &fi);
+			h = mix(h, data, st.st_size);
+			free(data);
+		}
+		free(list.name[i]);
+	}
+	free(list.name);
+	return h;
+}
+
+//Load image contents in a fresh process, as a mount would. Returns the
+//digest of the loaded tree, 0 if loading failed.
+static uint64_t load_digest(const char *data, ssize_t size) {
+	FILE *fp = fopen(image, "wb");
+	if (fp == NULL || (size > 0 && fwrite(data, size, 1, fp) != 1) || fclose(fp) != 0) {
+		perror(image);
+		exit(1);
+	}
+
+	int pipefd[2];
+	uint64_t h = 0;
+	if (pipe(pipefd) != 0) {
+		perror("pipe");
+		exit(1);
+	}
+	pid_t pid = fork();
+	if (pid == 0) {
+		close(pipefd[0]);
+		fp = fopen(image, "rb");
+		if (fp && core_init() == 0 && read_entries_from_file(fp) == 0) {
+			h = digest("/", 0xcbf29ce484222325ULL);
+		}
+		if (write(pipefd[1], &h, sizeof(h)) != sizeof(h)) {
+			_exit(1);
+		}
+		_exit(0);
+	}
+	close(pipefd[1]);
+	if (pid < 0 || read(pipefd[0], &h, sizeof(h)) != sizeof(h)) {
+		h = 0;
+	}
+	close(pipefd[0]);
+	waitpid(pid, NULL, 0);
+	return h;
+}
+
+static void check(int res, const char *what) {
+	if (res < 0) {
+		fprintf(stderr, "%s: %s\n", what, strerror(-res));
+		exit(1);
+	}
+}
+
+static void write_file(const char *path, size_t size, char fill) {
+	struct fuse_file_info fi = { 0 };
+	char *data = malloc(size);
+	memset(data, fill, size);
+	check(lfs_open(path, &fi), "open");
+	check(lfs_write(path, data, size, 0, &fi), "write");
+	check(lfs_release(path, &fi), "release");
+	free(data);
+}
+
+static void build_a(void) {
+	char path[64];
+	check(lfs_mkdir("/a", 0755), "mkdir");
+	check(lfs_mkdir("/a/b", 0755), "mkdir");
+	for (int i = 0; i < 40; i++) {
+		snprintf(path, sizeof(path), i % 2 ? "/a/f%d" : "/a/b/f%d", i);
+		check(lfs_mknod(path, 0644, 0), "mknod");
+		write_file(path, i * 997 % 20000, 'a' + i % 26);
+	}
+}
+
+static void change_to_b(void) {
+	char path[64];
+	check(lfs_unlink("/a/f1"), "unlink");
+	check(lfs_truncate("/a/b/f2", 100, NULL), "truncate");
+	write_file("/a/f3", 30000, 'z');
+	check(lfs_mkdir("/c", 0755), "mkdir");
+	for (int i = 0; i < 10; i++) {
+		snprintf(path, sizeof(path), "/c/g%d", i);
+		check(lfs_mknod(path, 0644, 0), "mknod");
+		write_file(path, 5000 + i, 'A' + i);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "r:s:o:S")) != -1) {
+		switch (opt) {
+		case 'r':
+			variants = atoi(optarg);
+			break;
+		case 's':
+			seed = atoi(optarg);
+			break;
+		case 'o':
+			image = optarg;
+			break;
+		case 'S':
+			no_fsync = true;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-r variants] [-s seed] [-o image] [-S]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	for (int fd = 0; fd < MAX_FDS; fd++) {
+		fds[fd].name = -1;
+	}
+	image_io.open = rec_open;
+	image_io.write = rec_write;
+	image_io.fsync = rec_fsync;
+	image_io.close = rec_close;
+	image_io.rename = rec_rename;
+
+	check(core_init(), "init");
+	build_a();
+	check(store_image(image, true), "save A");
+	int base_ops = nops;
+	change_to_b();
+	check(store_image(image, false), "save B");
+
+	char *data;
+	ssize_t size = crash_image(base_ops, base_ops, 0, &data);
+	uint64_t a = size < 0 ? 0 : load_digest(data, size);
+	size = crash_image(base_ops, nops, 0, &data);
+	uint64_t b = size < 0 ? 0 : load_digest(data, size);
+	if (a == 0 || b == 0 || a == b) {
+		fprintf(stderr, "could not load the images of state A and B\n");
+		return 1;
+	}
+
+	int runs = 0, failures = 0;
+	for (int crash = base_ops; crash <= nops; crash++) {
+		for (int variant = 0; variant < 2 + variants; variant++) {
+			size = crash_image(base_ops, crash, variant, &data);
+			uint64_t h = size < 0 ? 0 : load_digest(data, size);
+			runs++;
+			if (h != a && h != b) {
+				failures++;
+				printf("crash before call %d of %d, variant %d: %s\n", crash - base_ops, nops - base_ops,
+					variant, size < 0 ? "no image" : h ? "tree is neither A nor B" : "image does not load");
+			}
+		}
+	}
+	unlink(image);
+	printf("%d calls, %d crash states, %d failed\n", nops - base_ops, runs, failures);
+	return failures ? 1 : 0;
+}
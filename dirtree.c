@@ -0,0 +1,330 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dirtree.h"
+
+// Nodes hold up to ORDER - 1 keys. A leaf of 64 names is about 1.5 KiB.
+#define ORDER 64
+
+// Low bits of a key tell names with the same hash apart.
+#define SEQ_BITS 16
+#define SEQ_MAX ((1 << SEQ_BITS) - 1)
+
+// Leaves hold the names, internal nodes only separator keys: child[i] holds
+// the keys below keys[i] and child[i + 1] the keys from keys[i] and up.
+// Leaves are linked so a listing can walk them in order.
+struct dirtree_node {
+	bool leaf;
+	int n;
+	uint64_t keys[ORDER];
+	union {
+		struct dirtree_node *child[ORDER + 1];
+		struct {
+			const char *name[ORDER];
+			void *value[ORDER];
+			struct dirtree_node *prev;
+			struct dirtree_node *next;
+		};
+	};
+};
+
+struct dirtree {
+	struct dirtree_node *root;
+	size_t count;
+};
+
+//FNV-1a with a final mix so similar names spread over the whole range.
+static uint64_t hash_name(const char *name, size_t len) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char) name[i];
+		h *= 0x100000001b3ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+//First key that name can have. Keys stay below 2^63 so they fit in off_t.
+static uint64_t base_key(const char *name, size_t len) {
+	return ((hash_name(name, len) >> (SEQ_BITS + 2)) << SEQ_BITS) + DIRTREE_FIRST_KEY;
+}
+
+//Index of the first key greater than key.
+static int upper_bound(const uint64_t *keys, int n, uint64_t key) {
+	int lo = 0, hi = n;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (keys[mid] <= key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+static struct dirtree_node *new_node(bool leaf) {
+	struct dirtree_node *node = calloc(1, sizeof(struct dirtree_node));
+	if (node) {
+		node->leaf = leaf;
+	}
+	return node;
+}
+
+static void free_node(struct dirtree_node *node) {
+	if (!node->leaf) {
+		for (int i = 0; i <= node->n; i++) {
+			free_node(node->child[i]);
+		}
+	}
+	free(node);
+}
+
+struct dirtree *dirtree_new(void) {
+	struct dirtree *t = calloc(1, sizeof(struct dirtree));
+	if (t == NULL) {
+		return NULL;
+	}
+	t->root = new_node(true);
+	if (t->root == NULL) {
+		free(t);
+		return NULL;
+	}
+	return t;
+}
+
+void dirtree_free(struct dirtree *t) {
+	if (t) {
+		free_node(t->root);
+		free(t);
+	}
+}
+
+size_t dirtree_count(struct dirtree *t) {
+	return t->count;
+}
+
+void dirtree_seek(struct dirtree *t, uint64_t after, struct dirtree_iter *it) {
+	struct dirtree_node *node = t->root;
+	while (!node->leaf) {
+		node = node->child[upper_bound(node->keys, node->n, after)];
+	}
+	it->leaf = node;
+	it->pos = upper_bound(node->keys, node->n, after);
+}
+
+void *dirtree_next(struct dirtree_iter *it, uint64_t *key) {
+	while (it->leaf && it->pos >= it->leaf->n) {
+		it->leaf = it->leaf->next;
+		it->pos = 0;
+	}
+	if (it->leaf == NULL) {
+		return NULL;
+	}
+	if (key) {
+		*key = it->leaf->keys[it->pos];
+	}
+	return it->leaf->value[it->pos++];
+}
+
+//Find the key of a name, or 0 if it is not there. If free_key is given it is
+//set to the first unused key for the name's hash, or 0 if all are taken.
+static uint64_t find_key(struct dirtree *t, const char *name, size_t len, uint64_t *free_key) {
+	uint64_t base = base_key(name, len);
+	uint64_t next = base;
+	struct dirtree_iter it;
+
+	dirtree_seek(t, base - 1, &it);
+	for (;;) {
+		while (it.leaf && it.pos >= it.leaf->n) {
+			it.leaf = it.leaf->next;
+			it.pos = 0;
+		}
+		if (it.leaf == NULL || it.leaf->keys[it.pos] > base + SEQ_MAX) {
+			break;
+		}
+		uint64_t key = it.leaf->keys[it.pos];
+		const char *other = it.leaf->name[it.pos];
+		if (strncmp(other, name, len) == 0 && other[len] == '\0') {
+			return key;
+		}
+		if (key == next) {
+			next++;
+		}
+		it.pos++;
+	}
+	if (free_key) {
+		*free_key = next <= base + SEQ_MAX ? next : 0;
+	}
+	return 0;
+}
+
+//Split the full child i of parent in two. parent must not be full.
+static int split_child(struct dirtree_node *parent, int i) {
+	struct dirtree_node *child = parent->child[i];
+	struct dirtree_node *right = new_node(child->leaf);
+	uint64_t sep;
+
+	if (right == NULL) {
+		return -ENOMEM;
+	}
+	if (child->leaf) {
+		int half = child->n / 2;
+		right->n = child->n - half;
+		memcpy(right->keys, &child->keys[half], right->n * sizeof(uint64_t));
+		memcpy(right->name, &child->name[half], right->n * sizeof(char *));
+		memcpy(right->value, &child->value[half], right->n * sizeof(void *));
+		child->n = half;
+		right->next = child->next;
+		right->prev = child;
+		if (child->next) {
+			child->next->prev = right;
+		}
+		child->next = right;
+		sep = right->keys[0];
+	} else {
+		int mid = child->n / 2;
+		sep = child->keys[mid];
+		right->n = child->n - mid - 1;
+		memcpy(right->keys, &child->keys[mid + 1], right->n * sizeof(uint64_t));
+		memcpy(right->child, &child->child[mid + 1], (right->n + 1) * sizeof(struct dirtree_node *));
+		child->n = mid;
+	}
+
+	memmove(&parent->keys[i + 1], &parent->keys[i], (parent->n - i) * sizeof(uint64_t));
+	memmove(&parent->child[i + 2], &parent->child[i + 1], (parent->n - i) * sizeof(struct dirtree_node *));
+	parent->keys[i] = sep;
+	parent->child[i + 1] = right;
+	parent->n++;
+	return 0;
+}
+
+//Full nodes are split on the way down, so a failed allocation never leaves
+//the tree half changed.
+int dirtree_insert(struct dirtree *t, const char *name, void *value) {
+	uint64_t key;
+	if (find_key(t, name, strlen(name), &key)) {
+		return -EEXIST;
+	}
+	if (key == 0) {
+		return -ENOSPC;
+	}
+
+	if (t->root->n == ORDER - 1) {
+		struct dirtree_node *root = new_node(false);
+		if (root == NULL) {
+			return -ENOMEM;
+		}
+		root->child[0] = t->root;
+		if (split_child(root, 0) != 0) {
+			free(root);
+			return -ENOMEM;
+		}
+		t->root = root;
+	}
+
+	struct dirtree_node *node = t->root;
+	while (!node->leaf) {
+		int i = upper_bound(node->keys, node->n, key);
+		if (node->child[i]->n == ORDER - 1) {
+			if (split_child(node, i) != 0) {
+				return -ENOMEM;
+			}
+			if (key >= node->keys[i]) {
+				i++;
+			}
+		}
+		node = node->child[i];
+	}
+
+	int pos = upper_bound(node->keys, node->n, key);
+	memmove(&node->keys[pos + 1], &node->keys[pos], (node->n - pos) * sizeof(uint64_t));
+	memmove(&node->name[pos + 1], &node->name[pos], (node->n - pos) * sizeof(char *));
+	memmove(&node->value[pos + 1], &node->value[pos], (node->n - pos) * sizeof(void *));
+	node->keys[pos] = key;
+	node->name[pos] = name;
+	node->value[pos] = value;
+	node->n++;
+	t->count++;
+	return 0;
+}
+
+//Remove key from the subtree at node. Nodes are not merged when they get
+//small, only freed when empty; returns true if node is now empty.
+static bool remove_rec(struct dirtree_node *node, uint64_t key, void **value) {
+	int pos = upper_bound(node->keys, node->n, key);
+
+	if (node->leaf) {
+		pos--;
+		if (pos < 0 || node->keys[pos] != key) {
+			return false;
+		}
+		*value = node->value[pos];
+		memmove(&node->keys[pos], &node->keys[pos + 1], (node->n - pos - 1) * sizeof(uint64_t));
+		memmove(&node->name[pos], &node->name[pos + 1], (node->n - pos - 1) * sizeof(char *));
+		memmove(&node->value[pos], &node->value[pos + 1], (node->n - pos - 1) * sizeof(void *));
+		node->n--;
+		return node->n == 0;
+	}
+
+	struct dirtree_node *child = node->child[pos];
+	if (!remove_rec(child, key, value)) {
+		return false;
+	}
+	if (child->leaf) {
+		if (child->prev) {
+			child->prev->next = child->next;
+		}
+		if (child->next) {
+			child->next->prev = child->prev;
+		}
+	}
+	free(child);
+
+	if (node->n == 0) {
+		return true;
+	}
+	//Drop the child and the separator next to it.
+	int k = pos > 0 ? pos - 1 : 0;
+	memmove(&node->keys[k], &node->keys[k + 1], (node->n - k - 1) * sizeof(uint64_t));
+	memmove(&node->child[pos], &node->child[pos + 1], (node->n - pos) * sizeof(struct dirtree_node *));
+	node->n--;
+	return false;
+}
+
+void *dirtree_remove(struct dirtree *t, const char *name) {
+	uint64_t key = find_key(t, name, strlen(name), NULL);
+	if (key == 0) {
+		return NULL;
+	}
+
+	void *value = NULL;
+	if (remove_rec(t->root, key, &value) && !t->root->leaf) {
+		//Everything is gone, turn the internal root into an empty leaf.
+		memset(t->root, 0, sizeof(struct dirtree_node));
+		t->root->leaf = true;
+	}
+	while (!t->root->leaf && t->root->n == 0) {
+		struct dirtree_node *only = t->root->child[0];
+		free(t->root);
+		t->root = only;
+	}
+	t->count--;
+	return value;
+}
+
+void *dirtree_lookup(struct dirtree *t, const char *name, size_t len) {
+	uint64_t key = find_key(t, name, len, NULL);
+	if (key == 0) {
+		return NULL;
+	}
+	struct dirtree_iter it;
+	dirtree_seek(t, key - 1, &it);
+	return dirtree_next(&it, NULL);
+}
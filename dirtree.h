@@ -0,0 +1,49 @@
+#ifndef DIRTREE_H
+#define DIRTREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Ordered index of the names in one directory.
+//
+// Names are kept in a B+tree keyed by a hash of the name. The key of a name
+// never changes while the name is in the directory, so it doubles as the
+// readdir offset: a listing resumes with the first key after the offset in
+// O(log n), and names created or removed while a listing is in progress do
+// not cause the other names to be skipped or returned twice.
+//
+// Keys 0, 1 and 2 are never used, they are left for the start of the
+// listing, "." and "..".
+
+#define DIRTREE_FIRST_KEY 3
+
+struct dirtree;
+
+// Position in a directory listing.
+struct dirtree_iter {
+	struct dirtree_node *leaf;
+	int pos;
+};
+
+struct dirtree *dirtree_new(void);
+void dirtree_free(struct dirtree *t);
+size_t dirtree_count(struct dirtree *t);
+
+// Add name to the directory. name must stay valid until it is removed.
+// Returns 0, -EEXIST or -ENOMEM.
+int dirtree_insert(struct dirtree *t, const char *name, void *value);
+
+// Find the first len bytes of name. Returns the value or NULL.
+void *dirtree_lookup(struct dirtree *t, const char *name, size_t len);
+
+// Remove name. Returns the value that was stored or NULL.
+void *dirtree_remove(struct dirtree *t, const char *name);
+
+// Position it on the first name with a key greater than after.
+void dirtree_seek(struct dirtree *t, uint64_t after, struct dirtree_iter *it);
+
+// Return the value at it and advance, or NULL at the end of the directory.
+// key is set to the readdir offset of the returned name.
+void *dirtree_next(struct dirtree_iter *it, uint64_t *key);
+
+#endif
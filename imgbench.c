@@ -0,0 +1,212 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "benchfill.h"
+#include "core.h"
+#include "stats.h"
+
+// Image save and load benchmark, run on the core without a mount.
+//
+//     ./imgbench [-n files,...] [-D depth,...] [-f file bytes,...] [-o image]
+//
+// For every combination of the lists it builds a tree of that many files,
+// each at the given directory depth and holding that many bytes, saves it to
+// the image and loads it back. Saving and loading each run in a process of
+// their own so the peak RSS of each can be told apart; for the save that
+// includes building the tree, as in a mounted lfs.
+//
+// Output is one line per combination with the entries written (files and
+// directories), the image size, save and load time in milliseconds and the
+// peak RSS of the save and load processes in KiB.
+
+// Files per leaf directory.
+#define FILES_PER_DIR 100
+
+#define MAX_VALUES 16
+
+static long files[MAX_VALUES] = { 10000 };
+static int nfiles_values = 1;
+static long depths[MAX_VALUES] = { 3 };
+static int ndepths = 1;
+static long sizes[MAX_VALUES] = { 4096 };
+static int nsizes = 1;
+static const char *image = "/tmp/imgbench.img";
+
+static void check(int res, const char *what) {
+	if (res < 0) {
+		fprintf(stderr, "%s: %s\n", what, strerror(-res));
+		exit(1);
+	}
+}
+
+//Parse a comma separated list of numbers.
+static int parse_list(const char *arg, long *values) {
+	int n = 0;
+	while (*arg && n < MAX_VALUES) {
+		char *end;
+		values[n++] = strtol(arg, &end, 0);
+		if (end == arg || values[n - 1] < 0) {
+			return -1;
+		}
+		arg = *end == ',' ? end + 1 : end;
+	}
+	return n;
+}
+
+//Make n files of size bytes, FILES_PER_DIR to a directory, each directory
+//depth levels down.
+static void build_tree(long n, long depth, long size) {
+	char path[4096];
+	char *data = malloc(size ? size : 1);
+	struct fuse_file_info fi;
+
+	for (long i = 0; i < n; i++) {
+		if (i % FILES_PER_DIR == 0) {
+			//A new chain of directories for the next batch of files.
+			int len = 0;
+			for (long d = 0; d < depth; d++) {
+				len += snprintf(path + len, sizeof(path) - len, "/d%ld", d ? d : i / FILES_PER_DIR);
+				check(lfs_mkdir(path, 0755), "mkdir");
+			}
+		}
+		int len = 0;
+		for (long d = 0; d < depth; d++) {
+			len += snprintf(path + len, sizeof(path) - len, "/d%ld", d ? d : i / FILES_PER_DIR);
+		}
+		snprintf(path + len, sizeof(path) - len, "/f%ld", i);
+		check(lfs_mknod(path, 0644, 0), "mknod");
+		if (size) {
+			memset(&fi, 0, sizeof(fi));
+			check(lfs_open(path, &fi), "open");
+			bench_fill(data, size, i);
+			check(lfs_write(path, data, size, 0, &fi), "write");
+			check(lfs_release(path, &fi), "release");
+		}
+	}
+	free(data);
+}
+
+//Run fn in a child process. Returns what fn sent back and sets rss to the
+//child's peak RSS in KiB.
+static double in_child(double (*fn)(long, long, long), long n, long depth, long size, long *rss) {
+	int pipefd[2];
+	double result = -1;
+	struct rusage usage;
+	int status;
+
+	if (pipe(pipefd) != 0) {
+		perror("pipe");
+		exit(1);
+	}
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		close(pipefd[0]);
+		result = fn(n, depth, size);
+		if (write(pipefd[1], &result, sizeof(result)) != sizeof(result)) {
+			_exit(1);
+		}
+		_exit(0);
+	}
+	close(pipefd[1]);
+	if (read(pipefd[0], &result, sizeof(result)) != sizeof(result)) {
+		result = -1;
+	}
+	close(pipefd[0]);
+	wait4(pid, &status, 0, &usage);
+	*rss = usage.ru_maxrss;
+	return result;
+}
+
+//Build the tree and save it, returns the save time in ms.
+static double save(long n, long depth, long size) {
+	check(core_init(), "init");
+	build_tree(n, depth, size);
+	FILE *fp = fopen(image, "wb");
+	if (fp == NULL) {
+		perror(image);
+		_exit(1);
+	}
+	uint64_t start = stats_now();
+	check(write_entries_to_file(fp, true), "save");
+	return (stats_now() - start) / 1e6;
+}
+
+static double load(long n, long depth, long size) {
+	check(core_init(), "init");
+	FILE *fp = fopen(image, "rb");
+	if (fp == NULL) {
+		perror(image);
+		_exit(1);
+	}
+	uint64_t start = stats_now();
+	check(read_entries_from_file(fp), "load");
+	return (stats_now() - start) / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "n:D:f:o:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nfiles_values = parse_list(optarg, files);
+			break;
+		case 'D':
+			ndepths = parse_list(optarg, depths);
+			break;
+		case 'f':
+			nsizes = parse_list(optarg, sizes);
+			break;
+		case 'o':
+			image = optarg;
+			break;
+		default:
+			nfiles_values = -1;
+			break;
+		}
+	}
+	if (nfiles_values <= 0 || ndepths <= 0 || nsizes <= 0 || optind != argc) {
+		fprintf(stderr, "usage: %s [-n files,...] [-D depth,...] [-f file bytes,...] [-o image]\n", argv[0]);
+		return 1;
+	}
+	for (int i = 0; i < ndepths; i++) {
+		if (depths[i] < 1) {
+			fprintf(stderr, "%s: depth must be at least 1\n", argv[0]);
+			return 1;
+		}
+	}
+
+	printf("%10s %6s %10s %10s %14s %10s %10s %12s %12s\n", "files", "depth", "file_bytes", "entries",
+		"image_bytes", "save_ms", "load_ms", "save_rss_kb", "load_rss_kb");
+	for (int i = 0; i < nfiles_values; i++) {
+		for (int j = 0; j < ndepths; j++) {
+			for (int k = 0; k < nsizes; k++) {
+				long n = files[i], depth = depths[j], size = sizes[k];
+				long save_rss, load_rss;
+				struct stat st;
+
+				double save_ms = in_child(save, n, depth, size, &save_rss);
+				double load_ms = in_child(load, n, depth, size, &load_rss);
+				if (save_ms < 0 || load_ms < 0 || stat(image, &st) != 0) {
+					fprintf(stderr, "%s: run failed\n", argv[0]);
+					return 1;
+				}
+				long entries = n + (n + FILES_PER_DIR - 1) / FILES_PER_DIR * depth;
+				printf("%10ld %6ld %10ld %10ld %14lld %10.1f %10.1f %12ld %12ld\n", n, depth, size,
+					entries, (long long) st.st_size, save_ms, load_ms, save_rss, load_rss);
+			}
+		}
+	}
+	unlink(image);
+	return 0;
+}
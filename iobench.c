@@ -0,0 +1,281 @@
+// O_DIRECT
+#define _GNU_SOURCE
+
+#include <aio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "benchfill.h"
+
+// Data path benchmark in the style of fio, run against a mounted lfs and,
+// for comparison, another directory such as a tmpfs.
+//
+//     ./iobench [-b block size] [-q queue depth] [-t threads] [-s MiB] [-d] <dir>...
+//
+// For every dir, each thread writes a file of its own sequentially, then
+// writes, reads and randomly reads and writes it again in blocks, one phase
+// at a time. With a queue depth above 1 each thread keeps that many requests
+// in flight with POSIX AIO, otherwise it uses plain pread and pwrite. -d
+// opens the files with O_DIRECT to go around the page cache. Every block
+// written has content of its own, see benchfill.h.
+//
+// Output is a settings line, then one line per dir and phase with MB/s,
+// IOPS and latency percentiles in microseconds. The format is kept stable
+// so results can be compared between runs.
+
+static size_t block_size = 4096;
+static int queue_depth = 1;
+static int nthreads = 1;
+static size_t file_size = 64 << 20;
+static int direct;
+
+enum phase {
+	SEQ_WRITE,
+	SEQ_READ,
+	RAND_WRITE,
+	RAND_READ,
+	PHASES
+};
+
+static const char *phase_names[PHASES] = { "seqwrite", "seqread", "randwrite", "randread" };
+
+struct job {
+	pthread_t thread;
+	int fd;
+	unsigned int seed;
+	char *buf;
+	// latency of every request of the current phase, in ns
+	uint64_t *lat;
+	size_t nlat;
+};
+
+static struct job *jobs;
+static size_t nblocks;
+static pthread_barrier_t barrier;
+static int current;
+static uint64_t phase_start;
+static uint64_t phase_end;
+
+static uint64_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static off_t next_offset(struct job *job, size_t i) {
+	if (current == RAND_WRITE || current == RAND_READ) {
+		return (off_t) (rand_r(&job->seed) % nblocks) * block_size;
+	}
+	return (off_t) i * block_size;
+}
+
+static bool is_write(void) {
+	return current == SEQ_WRITE || current == RAND_WRITE;
+}
+
+//Give the block written at offset bytes of its own for this job and phase.
+static void fill_block(struct job *job, char *buf, off_t offset) {
+	uint64_t n = (uint64_t) (job - jobs) << 48 | (uint64_t) current << 40 | offset / block_size;
+	bench_fill(buf, block_size, n);
+}
+
+static void fail(const char *what) {
+	fprintf(stderr, "%s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+static void run_sync(struct job *job) {
+	for (size_t i = 0; i < nblocks; i++) {
+		off_t offset = next_offset(job, i);
+		if (is_write()) {
+			fill_block(job, job->buf, offset);
+		}
+		uint64_t start = now();
+		ssize_t n = is_write() ? pwrite(job->fd, job->buf, block_size, offset) :
+			pread(job->fd, job->buf, block_size, offset);
+		if (n < 0) {
+			fail(phase_names[current]);
+		}
+		job->lat[job->nlat++] = now() - start;
+	}
+}
+
+//Keep queue_depth requests in flight until nblocks are done.
+static void run_aio(struct job *job) {
+	struct aiocb *cbs = calloc(queue_depth, sizeof(struct aiocb));
+	const struct aiocb **wait = calloc(queue_depth, sizeof(struct aiocb *));
+	uint64_t *started = calloc(queue_depth, sizeof(uint64_t));
+	size_t issued = 0;
+	int active = 0;
+
+	for (int q = 0; q < queue_depth; q++) {
+		cbs[q].aio_fildes = job->fd;
+		cbs[q].aio_buf = job->buf + q * block_size;
+		cbs[q].aio_nbytes = block_size;
+	}
+	for (;;) {
+		for (int q = 0; q < queue_depth && issued < nblocks; q++) {
+			if (wait[q]) {
+				continue;
+			}
+			cbs[q].aio_offset = next_offset(job, issued++);
+			if (is_write()) {
+				fill_block(job, job->buf + q * block_size, cbs[q].aio_offset);
+			}
+			started[q] = now();
+			if ((is_write() ? aio_write(&cbs[q]) : aio_read(&cbs[q])) != 0) {
+				fail(phase_names[current]);
+			}
+			wait[q] = &cbs[q];
+			active++;
+		}
+		if (active == 0) {
+			break;
+		}
+		aio_suspend(wait, queue_depth, NULL);
+		for (int q = 0; q < queue_depth; q++) {
+			if (wait[q] == NULL || aio_error(&cbs[q]) == EINPROGRESS) {
+				continue;
+			}
+			if (aio_return(&cbs[q]) < 0) {
+				errno = aio_error(&cbs[q]);
+				fail(phase_names[current]);
+			}
+			job->lat[job->nlat++] = now() - started[q];
+			wait[q] = NULL;
+			active--;
+		}
+	}
+	free(cbs);
+	free(wait);
+	free(started);
+}
+
+//The main thread picks the phase, releases the workers on the first
+//barrier and stops the clock when all of them reach the second.
+static void *worker(void *arg) {
+	struct job *job = arg;
+	for (int p = 0; p < PHASES; p++) {
+		pthread_barrier_wait(&barrier);
+		job->nlat = 0;
+		if (queue_depth > 1) {
+			run_aio(job);
+		} else {
+			run_sync(job);
+		}
+		if (is_write() && fsync(job->fd) != 0) {
+			fail("fsync");
+		}
+		pthread_barrier_wait(&barrier);
+	}
+	return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char *dir, uint64_t *all) {
+	size_t n = 0;
+	for (int t = 0; t < nthreads; t++) {
+		memcpy(all + n, jobs[t].lat, jobs[t].nlat * sizeof(uint64_t));
+		n += jobs[t].nlat;
+	}
+	qsort(all, n, sizeof(uint64_t), compare_u64);
+	double secs = (phase_end - phase_start) / 1e9;
+	printf("%-24s %-10s %10.1f %10.0f %10.2f %10.2f %10.2f %10.2f\n", dir, phase_names[current],
+		n * (double) block_size / secs / 1e6, n / secs, all[n / 2] / 1000.0, all[n * 99 / 100] / 1000.0,
+		all[n * 999 / 1000] / 1000.0, all[n - 1] / 1000.0);
+}
+
+static void run_dir(const char *dir) {
+	char path[PATH_MAX];
+	uint64_t *all = malloc(nthreads * nblocks * sizeof(uint64_t));
+
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for (int t = 0; t < nthreads; t++) {
+		struct job *job = &jobs[t];
+		snprintf(path, sizeof(path), "%s/iobench.%d", dir, t);
+		job->fd = open(path, O_CREAT | O_TRUNC | O_RDWR | (direct ? O_DIRECT : 0), 0644);
+		if (job->fd < 0) {
+			fail(path);
+		}
+		job->seed = t + 1;
+		if (posix_memalign((void **) &job->buf, 4096, queue_depth * block_size) != 0 ||
+				(job->lat = malloc(nblocks * sizeof(uint64_t))) == NULL || all == NULL) {
+			fail("out of memory");
+		}
+		if (pthread_create(&job->thread, NULL, worker, job) != 0) {
+			fail("pthread_create");
+		}
+	}
+	for (int p = 0; p < PHASES; p++) {
+		current = p;
+		phase_start = now();
+		pthread_barrier_wait(&barrier);
+		pthread_barrier_wait(&barrier);
+		phase_end = now();
+		report(dir, all);
+	}
+	for (int t = 0; t < nthreads; t++) {
+		pthread_join(jobs[t].thread, NULL);
+		close(jobs[t].fd);
+		snprintf(path, sizeof(path), "%s/iobench.%d", dir, t);
+		unlink(path);
+		free(jobs[t].buf);
+		free(jobs[t].lat);
+	}
+	pthread_barrier_destroy(&barrier);
+	free(all);
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "b:q:t:s:d")) != -1) {
+		switch (opt) {
+		case 'b':
+			block_size = atoi(optarg);
+			break;
+		case 'q':
+			queue_depth = atoi(optarg);
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 's':
+			file_size = (size_t) atoi(optarg) << 20;
+			break;
+		case 'd':
+			direct = 1;
+			break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+	if (optind >= argc || block_size == 0 || queue_depth <= 0 || nthreads <= 0 || file_size < block_size) {
+		fprintf(stderr, "usage: %s [-b block size] [-q queue depth] [-t threads] [-s MiB per thread] [-d] <dir>...\n", argv[0]);
+		return 1;
+	}
+	nblocks = file_size / block_size;
+	jobs = calloc(nthreads, sizeof(struct job));
+
+	printf("# iobench bs=%zu qd=%d threads=%d size=%zu direct=%d\n", block_size, queue_depth, nthreads, file_size, direct);
+	printf("%-24s %-10s %10s %10s %10s %10s %10s %10s\n", "dir", "phase", "MB/s", "IOPS",
+		"p50_us", "p99_us", "p999_us", "max_us");
+	for (int i = optind; i < argc; i++) {
+		run_dir(argv[i]);
+	}
+	free(jobs);
+	return 0;
+}
@@ -1,571 +1,843 @@
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "core.h"
+#include "pool.h"
+#include "log.h"
+#include "stats.h"
+#include "optrace.h"
+
+// Default kernel cache lifetimes in seconds. We are the only writer to the
+// mount, so the kernel can keep names and attributes for a long time.
+#define DEFAULT_ENTRY_TIMEOUT 60.0
+#define DEFAULT_ATTR_TIMEOUT 60.0
+
+// Seconds between snapshots of the tree to the image file.
+#define DEFAULT_SNAPSHOT_INTERVAL 20
+
+// Files under this directory are made up by lfs itself, see control_files.
+#define CONTROL_DIR "/.lfs"
+#define CONTROL_DIR_LEN (sizeof(CONTROL_DIR) - 1)
+#define CONTROL_BUF (64 * 1024)
+
+void *lfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg);
+void lfs_destroy(void *private_data);
+
+// Mount options, parsed from "-o name=value" on the command line.
+struct lfs_options {
+	double entry_timeout;
+	double attr_timeout;
+	int writeback_cache;
+	int keep_cache;
+	char *image;
+	char *mountpoint;
+	char *trace_file;
+	int snapshot_interval;
+	char *op_trace;
+	int compress_after;
+	int hugepages;
+	int memory_limit;
+	int write_buffer;
+	int write_buffers;
+};
 
-#define MAX_ENTRIES 10
-
-int lfs_getattr( const char *, struct stat * );
-int lfs_readdir( const char *, void *, fuse_fill_dir_t, off_t, struct fuse_file_info * );
-int lfs_open( const char *, struct fuse_file_info * );
-int lfs_read( const char *, char *, size_t, off_t, struct fuse_file_info * );
-int lfs_release(const char *path, struct fuse_file_info *fi);
-int lfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
-int lfs_mkdir(const char *path, mode_t mode);
-int lfs_rmdir(const char *path);
-int lfs_mknod(const char *path, mode_t mode, dev_t dev);
-int lfs_unlink(const char *path);
-int lfs_utime(const char *path, struct utimbuf *ubuf);
-int lfs_truncate(const char *path, off_t size);
+#define LFS_OPT(t, p, v) { t, offsetof(struct lfs_options, p), v }
+
+static const struct fuse_opt lfs_opts[] = {
+	LFS_OPT("entry_timeout=%lf", entry_timeout, 0),
+	LFS_OPT("attr_timeout=%lf", attr_timeout, 0),
+	LFS_OPT("writeback_cache", writeback_cache, 1),
+	LFS_OPT("no_writeback_cache", writeback_cache, 0),
+	LFS_OPT("keep_cache", keep_cache, 1),
+	LFS_OPT("no_keep_cache", keep_cache, 0),
+	LFS_OPT("image=%s", image, 0),
+	LFS_OPT("trace_file=%s", trace_file, 0),
+	LFS_OPT("snapshot_interval=%d", snapshot_interval, 0),
+	LFS_OPT("op_trace=%s", op_trace, 0),
+	LFS_OPT("compress_after=%d", compress_after, 0),
+	LFS_OPT("hugepages", hugepages, 1),
+	LFS_OPT("memory_limit=%d", memory_limit, 0),
+	LFS_OPT("write_buffer=%d", write_buffer, 0),
+	LFS_OPT("write_buffers=%d", write_buffers, 0),
+	FUSE_OPT_END
+};
 
-static struct fuse_operations lfs_oper = {
-	.getattr	= lfs_getattr,
-	.readdir	= lfs_readdir,
-	.mknod = lfs_mknod,
-	.mkdir = lfs_mkdir,
-	.unlink = lfs_unlink,
-	.rmdir = lfs_rmdir,
-	.truncate = lfs_truncate,
-	.open	= lfs_open,
-	.read	= lfs_read,
-	.release = lfs_release,
-	.write = lfs_write,
-	.rename = NULL,
-	.utime = NULL
+static struct lfs_options options = {
+	.entry_timeout = DEFAULT_ENTRY_TIMEOUT,
+	.attr_timeout = DEFAULT_ATTR_TIMEOUT,
+	.writeback_cache = 1,
+	.keep_cache = 1,
+	.snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL,
+	.write_buffer = DEFAULT_WRITE_BUFFER,
+	.write_buffers = DEFAULT_WRITE_BUFFERS,
 };
 
-// entry in the system.
-struct entry {
-	char *name;
+
+// Callbacks that only read the tree share this lock, the rest and the
+// flusher's snapshot take it alone. See the op_ wrappers.
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Writes a snapshot of the tree to the image every snapshot_interval seconds.
+static pthread_t flusher;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static bool flusher_running;
+
+// Compresses the data of files not accessed for compress_after seconds, and
+// expands it again when they are.
+static pthread_t compressor;
+static pthread_mutex_t compress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compress_cond = PTHREAD_COND_INITIALIZER;
+static bool compressor_running;
+
+// Blocks and entries the compressor looks at per hold of fs_lock.
+#define COMPRESS_BATCH 256
+
+// Evicts blocks to the image while block data takes more than memory_limit
+// MiB, starting with files not accessed for EVICT_COLD_AGE seconds.
+static pthread_t evictor;
+static pthread_mutex_t evict_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t evict_cond = PTHREAD_COND_INITIALIZER;
+static bool evictor_running;
+
+#define EVICT_COLD_AGE 60
+
+// The flusher and the evictor both save, one at a time.
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Invalidation waiting to be pushed to the kernel by the notifier thread.
+// Notifications must not be sent from inside a request handler (the kernel
+// may be waiting on that request), so they are queued and sent from a
+// thread of their own.
+struct inval {
 	char *path;
-	char *full_path;
-	bool is_dir;
-	int file_size;
-	char* data;
-	time_t access_time;
-	time_t modification_time;
+	int what;
+	struct inval *next;
 };
 
-static struct entry *entries[MAX_ENTRIES];
-static int entries_count = 0;
-static FILE *fp;
-
-//method that print all entries in the system.
-void print_entries() {
-	printf("----------------print_entries----------------\n");
-	for (int i = 0; i < MAX_ENTRIES; i++)
-	{
-		if (entries[i]) {
-			printf("entries[i]->name: %s \n", entries[i]->name);
-			//Print the path
-			printf("entries[i]->full_path: %s \n", entries[i]->full_path);
+static struct fuse *lfs_fuse;
+static struct fuse_config *lfs_cfg;
+static pthread_t notifier;
+static pthread_mutex_t inval_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t inval_cond = PTHREAD_COND_INITIALIZER;
+static struct inval *inval_head;
+static struct inval **inval_tail = &inval_head;
+static bool notifier_running;
+
+//The core calls this through lfs_invalidate_hook for the entries an op
+//changes behind the kernel, with fs_lock held; it only touches the queue. A
+//path already waiting to be sent is not queued again.
+void lfs_invalidate(const char *path, int what) {
+	lfs_log(LOG_DEBUG, LOG_CACHE, "invalidate", path, what, 0);
+
+	pthread_mutex_lock(&inval_lock);
+	for (struct inval *queued = inval_head; queued; queued = queued->next) {
+		if (strcmp(queued->path, path) == 0) {
+			queued->what |= what;
+			pthread_mutex_unlock(&inval_lock);
+			return;
 		}
 	}
+	pthread_mutex_unlock(&inval_lock);
+
+	struct inval *inv = malloc(sizeof(struct inval));
+	char *copy = strdup(path);
+	if (inv == NULL || copy == NULL) {
+		lfs_log(LOG_ERROR, LOG_CACHE, "invalidate: out of memory", path, 0, 0);
+		free(inv);
+		free(copy);
+		return;
+	}
+	inv->path = copy;
+	inv->what = what;
+	inv->next = NULL;
+
+	pthread_mutex_lock(&inval_lock);
+	*inval_tail = inv;
+	inval_tail = &inv->next;
+	pthread_cond_signal(&inval_cond);
+	pthread_mutex_unlock(&inval_lock);
 }
 
-char* get_parent_path(const char* path) {
-	printf("----------------get_parent_path----------------\n");
-    char* last_slash = strrchr(path, '/');
-    if (last_slash == NULL) {
-        return NULL;
-    }
-    int parent_len = last_slash - path;
-    char* parent_path = (char*) malloc(parent_len + 2);
-    strncpy(parent_path, path, parent_len + 1);
-    parent_path[parent_len + 1] = '\0';
-	printf("parent_path: %s \n", parent_path);
-    return parent_path;
+//Push one invalidation to the kernel.
+static void send_invalidation(struct inval *inv) {
+	int err = 0;
+
+	if (inv->what & LFS_INVAL_INODE) {
+		//-ENOENT just means the kernel has nothing cached for it.
+		err = fuse_invalidate_path(lfs_fuse, inv->path);
+	}
+
+	if (inv->what & LFS_INVAL_ENTRY) {
+		//The high level library only exposes the node id of the root, the
+		//only directory whose names can be dropped. A name deeper down has
+		//its own inode invalidated instead: the kernel then asks for its
+		//attributes, which fails once it is removed. New names need
+		//nothing, the mount caches no negative entries.
+		const char *name = strrchr(inv->path, '/') + 1;
+		if (name == inv->path + 1) {
+			err = fuse_lowlevel_notify_inval_entry(fuse_get_session(lfs_fuse),
+				FUSE_ROOT_ID, name, strlen(name));
+		} else if (!(inv->what & LFS_INVAL_INODE)) {
+			err = fuse_invalidate_path(lfs_fuse, inv->path);
+		}
+	}
+
+	if (err && err != -ENOENT) {
+		lfs_log(LOG_ERROR, LOG_CACHE, "invalidation failed", inv->path, err, inv->what);
+	}
 }
 
-int find_empty_entry() {
-	printf("----------------find_empty_entry----------------\n");
-	for (int i = 0; i < MAX_ENTRIES; i++) {
-		if (entries[i] == NULL) {
-			return i;
+//Runs until stopped and the queue is empty, so nothing queued is lost.
+static void *notifier_main(void *arg) {
+	pthread_mutex_lock(&inval_lock);
+	while (notifier_running || inval_head) {
+		if (inval_head == NULL) {
+			pthread_cond_wait(&inval_cond, &inval_lock);
+			continue;
 		}
+		struct inval *inv = inval_head;
+		inval_head = inv->next;
+		if (inval_head == NULL) {
+			inval_tail = &inval_head;
+		}
+		pthread_mutex_unlock(&inval_lock);
+
+		send_invalidation(inv);
+		free(inv->path);
+		free(inv);
+
+		pthread_mutex_lock(&inval_lock);
 	}
-	printf("No more space for entries");
-	return -1;
+	pthread_mutex_unlock(&inval_lock);
+	return NULL;
 }
 
-char* get_entry_name(char *path) {
-	printf("----------------get_entry_name----------------\n");
-	char *name = strrchr(path, '/');
-	if (name == NULL) {
-		return path;
+//Snapshot the tree to the image. Runs while no callback changes the tree.
+static int save_image(void) {
+	pthread_mutex_lock(&save_lock);
+	//Writes the open files gather go in first, the save only reads the tree.
+	pthread_rwlock_wrlock(&fs_lock);
+	if (flush_handles() != 0) {
+		lfs_log(LOG_ERROR, LOG_PERSIST, "snapshot: writes left out, out of memory", NULL, 0, 0);
 	}
-	name = name + 1;
-    printf("name: %s \n", name);
-    return strdup(name);
+	pthread_rwlock_unlock(&fs_lock);
+	pthread_rwlock_rdlock(&fs_lock);
+	int err = store_image(options.image, true);
+	pthread_rwlock_unlock(&fs_lock);
+	pthread_mutex_unlock(&save_lock);
+	return err;
 }
 
-struct entry *get_entry(const char *path) {
-	printf("----------------*get_entry----------------\n");
-	for (int i = 0; i < MAX_ENTRIES; i++)
-	{	
-		printf("%d\n", i);
-		if (entries[i] != NULL) {
-			if (strcmp(entries[i]->full_path, path) == 0) {
-				printf("get_entry: found entry: %s \n", entries[i]->name);
-				return entries[i];
-			}
+//Save snapshot_interval seconds after the last save. The interval is read
+//again whenever the thread is woken, so a new one applies at once.
+static void *flusher_main(void *arg) {
+	struct timespec last;
+	clock_gettime(CLOCK_REALTIME, &last);
+	pthread_mutex_lock(&flush_lock);
+	while (flusher_running) {
+		struct timespec until = last;
+		until.tv_sec += options.snapshot_interval;
+		if (pthread_cond_timedwait(&flush_cond, &flush_lock, &until) != ETIMEDOUT) {
+			continue;
 		}
+		pthread_mutex_unlock(&flush_lock);
+		save_image();
+		pthread_mutex_lock(&flush_lock);
+		clock_gettime(CLOCK_REALTIME, &last);
 	}
-	printf("Entry not found");
+	pthread_mutex_unlock(&flush_lock);
 	return NULL;
-	
 }
 
-int lfs_getattr( const char *path, struct stat *stbuf ) {
-	printf("----------------lfs_getattr----------------\n");
-	printf("Get Attribute");
-	printf("getattr: (path=%s)\n", path);
-	memset( stbuf, 0, sizeof(struct stat) );
+static void wake_flusher(void) {
+	pthread_mutex_lock(&flush_lock);
+	pthread_cond_signal(&flush_cond);
+	pthread_mutex_unlock(&flush_lock);
+}
 
-	if(strcmp(path, "/") == 0) {
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 2;
-	} else {
-		struct entry *e = get_entry(path);
-		if (e == NULL) {
-			printf("lfs_getattr: Entry not found\n");
-			return -ENOENT;
-		}
-		if(e->is_dir) {
-			stbuf->st_mode = S_IFDIR | 0755;
-			stbuf->st_nlink = 2;
-		}
-		else {
-			stbuf->st_mode = S_IFREG | 0777;
-			stbuf->st_nlink = 1;
-			stbuf->st_size = e->file_size;
+//Run a pass every compress_after / 4 seconds, at least a second apart. Each
+//step of a pass holds fs_lock alone, so steps are kept short. With
+//compression off passes only run while blocks are compressed, to expand them.
+static void *compressor_main(void *arg) {
+	struct compress_cursor cur = { 0, 0 };
+	pthread_mutex_lock(&compress_lock);
+	while (compressor_running) {
+		int after = options.compress_after;
+		struct block_stats blocks;
+		block_get_stats(&blocks);
+		if (after > 0 || blocks.compressed > 0) {
+			time_t cutoff = after > 0 ? time(NULL) - after : 0;
+			bool done = false;
+			pthread_mutex_unlock(&compress_lock);
+			while (!done && __atomic_load_n(&compressor_running, __ATOMIC_RELAXED)) {
+				pthread_rwlock_wrlock(&fs_lock);
+				done = compress_step(cutoff, &cur, COMPRESS_BATCH);
+				pthread_rwlock_unlock(&fs_lock);
+			}
+			pthread_mutex_lock(&compress_lock);
 		}
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += after > 4 ? after / 4 : 1;
+		pthread_cond_timedwait(&compress_cond, &compress_lock, &until);
 	}
-	//print number of entries
-	printf("entries_count: %d \n", entries_count);
-	return 0;
+	pthread_mutex_unlock(&compress_lock);
+	return NULL;
 }
 
-int lfs_readdir( const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi ) {
-	printf("----------------lfs_readdir----------------\n");
-	// (void) offset;
-	// (void) fi;
-
-	printf("readdir: (path=%s)\n", path);
-
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
-
-	//If in directory.
-	if (path != NULL && strcmp(path, "/") != 0) {
-		printf("We are Not in root ");
-		//Find all files in the directory.
-		for (int i = 0; i < MAX_ENTRIES; i++)
-		{
-			if(entries[i]) {
-				printf("lfs_readdir: entries[i]->path: %s \n", entries[i]->path);
-				printf("path: %s \n", path);
-				//copy the path
-				char* tmp = strdup(path);
-				//Add a slash to the end of the path
-				strcat(tmp, "/");
-				if (strcmp(entries[i]->path, tmp) == 0) {
-					filler(buf, entries[i]->name, NULL, 0);
+static void wake_compressor(void) {
+	pthread_mutex_lock(&compress_lock);
+	pthread_cond_signal(&compress_cond);
+	pthread_mutex_unlock(&compress_lock);
+}
+
+//Check the memory limit every second. Only blocks that are in the image can
+//be evicted, so when two sweeps cannot get under the limit the tree is saved
+//once, which makes the blocks written since the last save clean, and the
+//sweeps tried again. Changed blocks are not written back one at a time: the
+//image is a whole snapshot, so making them clean costs a full save.
+static void *evictor_main(void *arg) {
+	struct evict_cursor cur = { 0, 0, 0 };
+	pthread_mutex_lock(&evict_lock);
+	while (evictor_running) {
+		size_t limit = (size_t) options.memory_limit << 20;
+		if (limit > 0 && block_memory() > limit) {
+			time_t cutoff = time(NULL) - EVICT_COLD_AGE;
+			bool saved = false;
+			int res = 0;
+			pthread_mutex_unlock(&evict_lock);
+			while (res != 1 && __atomic_load_n(&evictor_running, __ATOMIC_RELAXED)) {
+				pthread_rwlock_wrlock(&fs_lock);
+				res = evict_step(limit, cutoff, &cur, COMPRESS_BATCH);
+				pthread_rwlock_unlock(&fs_lock);
+				if (res == -1 && saved) {
+					lfs_log(LOG_ERROR, LOG_DATA, "memory limit not reached (limit, in use)", NULL,
+						limit, block_memory());
+					break;
+				}
+				if (res == -1) {
+					save_image();
+					saved = true;
 				}
 			}
+			pthread_mutex_lock(&evict_lock);
 		}
-		return 0;
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += 1;
+		pthread_cond_timedwait(&evict_cond, &evict_lock, &until);
 	}
+	pthread_mutex_unlock(&evict_lock);
+	return NULL;
+}
 
-	//If in root
-	//Find all files in the directory.
-	for (int i = 0; i < MAX_ENTRIES; i++)
-	{
-		if(entries[i]) {
-			printf("lfs_readdir: entries[i]->path: %s \n", entries[i]->path);
-			printf("path: %s \n", path);
-			if (strcmp(entries[i]->path, path) == 0) {
-				filler(buf, entries[i]->name, NULL, 0);
-			}
-		}
+static void wake_evictor(void) {
+	pthread_mutex_lock(&evict_lock);
+	pthread_cond_signal(&evict_cond);
+	pthread_mutex_unlock(&evict_lock);
+}
+
+void *lfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+	cfg->entry_timeout = options.entry_timeout;
+	cfg->attr_timeout = options.attr_timeout;
+	cfg->negative_timeout = 0;
+	//There is no rename to hide open files behind on unlink, the core keeps
+	//an unlinked file itself until its last release.
+	cfg->hard_remove = 1;
+
+	//Let the kernel buffer and merge small writes before sending them to us.
+	if (options.writeback_cache && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+		conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+		lfs_log(LOG_INFO, LOG_CACHE, "writeback cache enabled", NULL, 0, 0);
 	}
 
-	return 0;
+	//Always answer readdir with attributes so listings fill the kernel's
+	//entry and attribute caches without a lookup per name.
+	if (conn->capable & FUSE_CAP_READDIRPLUS) {
+		conn->want |= FUSE_CAP_READDIRPLUS;
+		conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+	}
+	lfs_log(LOG_INFO, LOG_CACHE, "timeouts (ms) entry attr", NULL,
+		cfg->entry_timeout * 1000, cfg->attr_timeout * 1000);
+
+	lfs_fuse = fuse_get_context()->fuse;
+	//The library reads the timeouts from here on every reply, so changes
+	//through the control files apply right away.
+	lfs_cfg = cfg;
+	if (options.trace_file && log_start_dumper(options.trace_file) != 0) {
+		lfs_log(LOG_ERROR, LOG_CACHE, "could not start trace dumper", options.trace_file, 0, 0);
+	}
+	if (options.op_trace) {
+		int err = optrace_open(options.op_trace);
+		if (err != 0) {
+			lfs_log(LOG_ERROR, LOG_META, "could not open op trace", options.op_trace, -err, 0);
+		}
+	}
+	notifier_running = true;
+	if (pthread_create(&notifier, NULL, notifier_main, NULL) != 0) {
+		lfs_log(LOG_ERROR, LOG_CACHE, "could not start notifier thread", NULL, 0, 0);
+		notifier_running = false;
+	} else {
+		lfs_invalidate_hook = lfs_invalidate;
+	}
+	//Started here and not in main, threads do not survive fuse daemonizing.
+	flusher_running = true;
+	if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+		lfs_log(LOG_ERROR, LOG_PERSIST, "could not start flusher thread", NULL, 0, 0);
+		flusher_running = false;
+	}
+	compressor_running = true;
+	if (pthread_create(&compressor, NULL, compressor_main, NULL) != 0) {
+		lfs_log(LOG_ERROR, LOG_DATA, "could not start compressor thread", NULL, 0, 0);
+		compressor_running = false;
+	}
+	evictor_running = true;
+	if (pthread_create(&evictor, NULL, evictor_main, NULL) != 0) {
+		lfs_log(LOG_ERROR, LOG_DATA, "could not start evictor thread", NULL, 0, 0);
+		evictor_running = false;
+	}
+	return NULL;
 }
-//Create a file node
-int lfs_mknod(const char *path, mode_t mode, dev_t rdev) {
-	printf("----------------lfs_mknod----------------\n");
-	printf("mknod: (path=%s)\n", path);
-	//Find an empty entry
-	int index = find_empty_entry();
-	if (index == -1) {
-		printf("lfs_mknod: No more space for entries");
-		return -1;
+
+//Memory use of every pool as a table, returns the length written.
+static size_t format_pool_stats(char *buf, size_t size) {
+	struct pool_stats stats[POOL_MAX];
+	int n = pool_get_stats(stats, POOL_MAX);
+	size_t len = snprintf(buf, size, "%-8s %8s %10s %8s %12s %12s\n", "pool", "size", "in_use", "slabs", "bytes", "allocs");
+	for (int i = 0; i < n && len < size; i++) {
+		len += snprintf(buf + len, size - len, "%-8s %8zu %10zu %8zu %12zu %12llu\n", stats[i].name, stats[i].object_size,
+			stats[i].in_use, stats[i].slabs, stats[i].bytes, (unsigned long long) stats[i].allocs);
 	}
-	//Create a new file
-	struct entry *e = (struct entry*) malloc(sizeof(struct entry));
-	e->name = get_entry_name(path);
-	e->path = get_parent_path(path);
-	e->full_path = strdup(path);
-	e->is_dir = 0;
-	e->file_size = 0;
-	e->access_time = time(NULL);
-	e->modification_time = time(NULL);
-	entries[index] = e;
-	entries_count++;
-	return 0;
+	return len < size ? len : size - 1;
 }
 
-int lfs_unlink(const char *path) {
-	printf("----------------lfs_unlink----------------\n");
-	printf("unlink: (path=%s)\n", path);
-	//Find the entry
-	struct entry *e = get_entry(path);
-	printf("----------------lfs_unlink----------------\n");
-	if (e == NULL) {
-		printf("lfs_unlink: Entry not found\n");
-		return -ENOENT;
+void lfs_destroy(void *private_data) {
+	optrace_close();
+	if (flusher_running) {
+		pthread_mutex_lock(&flush_lock);
+		flusher_running = false;
+		pthread_cond_signal(&flush_cond);
+		pthread_mutex_unlock(&flush_lock);
+		pthread_join(flusher, NULL);
 	}
-	//Remove the entry
-	for (int i = 0; i < MAX_ENTRIES; i++)
-	{
-		if (entries[i] == e) {
-			printf("SIKE!");
-			printf("lfs_unlink: file name %s: removed\n", entries[i]->name);
-			entries[i] = NULL;
-			free(e);
-			entries_count--;
-			return 0;
+	if (compressor_running) {
+		pthread_mutex_lock(&compress_lock);
+		__atomic_store_n(&compressor_running, false, __ATOMIC_RELAXED);
+		pthread_cond_signal(&compress_cond);
+		pthread_mutex_unlock(&compress_lock);
+		pthread_join(compressor, NULL);
+	}
+	if (evictor_running) {
+		pthread_mutex_lock(&evict_lock);
+		__atomic_store_n(&evictor_running, false, __ATOMIC_RELAXED);
+		pthread_cond_signal(&evict_cond);
+		pthread_mutex_unlock(&evict_lock);
+		pthread_join(evictor, NULL);
+	}
+	if (options.trace_file) {
+		FILE *out = fopen(options.trace_file, "a");
+		if (out) {
+			log_dump(out);
+			fclose(out);
 		}
 	}
-	printf("lfs_unlink: Entry not found\n");
-	return -ENOENT;
+	if (!notifier_running) {
+		return;
+	}
+	lfs_invalidate_hook = NULL;
+	pthread_mutex_lock(&inval_lock);
+	notifier_running = false;
+	pthread_cond_signal(&inval_cond);
+	pthread_mutex_unlock(&inval_lock);
+	pthread_join(notifier, NULL);
 }
 
-int lfs_open( const char *path, struct fuse_file_info *fi ) {
-	printf("----------------lfs_open----------------\n");
-	printf("open: (path=%s)\n", path);
-	//remove entry from entries array
-
-	struct entry *e = get_entry(path);
-	if (e == NULL) {
-		printf("lfs_open: Entry not found\n");
-		return -ENOENT;
+static void apply_timeouts(void) {
+	if (lfs_cfg) {
+		lfs_cfg->entry_timeout = options.entry_timeout;
+		lfs_cfg->attr_timeout = options.attr_timeout;
 	}
-	fi->fh = (uint64_t) e;
-	printf("fi->fh = (uint64_t) e\n");
-	return 0;
 }
 
-int lfs_read( const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi ) {
-	printf("----------------lfs_read----------------\n");
-    printf("read: (path=%s)\n", path);
+// Files in CONTROL_DIR. Their contents are made when the file is opened, so
+// a reader sees one consistent copy however it reads it. The directory is
+// not listed in the root, it is only found by name.
+//
+// A file either shows a report, or holds one tunable: reading it gives the
+// current value and writing a number in [min, max] sets it, then calls
+// changed to apply it.
+struct control_file {
+	const char *name;
+	size_t (*show)(char *buf, size_t size);
+	int *int_value;
+	double *double_value;
+	double min;
+	double max;
+	void (*changed)(void);
+};
 
-	struct entry *e = (struct entry*) fi->fh;
-	if (e == NULL) {
-		printf("lfs_open: Entry not found\n");
-		return -ENOENT;
-	}
-	if (e->data == NULL) {
-		printf("lfs_read: No data found\n");
-		return -ENOENT;
-	}
-	//Pinrt e->data
-	printf("e->data: %s\n", e->data);
+static const struct control_file control_files[] = {
+	{ "stats", stats_format },
+	{ "stats.json", stats_format_json },
+	{ "pools", format_pool_stats },
+	{ "blocks", block_format_stats },
+	{ "snapshot_interval", .int_value = &options.snapshot_interval, .min = 1, .max = 86400, .changed = wake_flusher },
+	{ "entry_timeout", .double_value = &options.entry_timeout, .min = 0, .max = 86400, .changed = apply_timeouts },
+	{ "attr_timeout", .double_value = &options.attr_timeout, .min = 0, .max = 86400, .changed = apply_timeouts },
+	{ "keep_cache", .int_value = &options.keep_cache, .min = 0, .max = 1 },
+	{ "compress_after", .int_value = &options.compress_after, .min = 0, .max = 365 * 86400, .changed = wake_compressor },
+	{ "memory_limit", .int_value = &options.memory_limit, .min = 0, .max = 1 << 30, .changed = wake_evictor },
+	{ "write_buffer", .int_value = &write_buffer, .min = 0, .max = 1 << 16 },
+	{ "write_buffers", .int_value = &write_buffers, .min = 0, .max = 1 << 20 },
+	{ "log_level", .int_value = &log_level, .min = 0, .max = LFS_LOG_LEVEL },
+	{ "log_categories", .int_value = &log_categories, .min = 0, .max = LOG_ALL },
+};
 
-	memcpy(buf, e->data, size); 
-	e->access_time = time(NULL);
+#define CONTROL_FILES (sizeof(control_files) / sizeof(control_files[0]))
 
-	//print buffer
-	printf("buf: %s\n", buf);
+struct control_handle {
+	size_t len;
+	char data[];
+};
 
-	return size;
+static bool is_control(const char *path) {
+	return strncmp(path, CONTROL_DIR, CONTROL_DIR_LEN) == 0 &&
+		(path[CONTROL_DIR_LEN] == '\0' || path[CONTROL_DIR_LEN] == '/');
 }
 
-int lfs_release(const char *path, struct fuse_file_info *fi) {
-	printf("release: (path=%s)\n", path);
-	return 0;
+//The control file at path, NULL for the directory or an unknown name.
+static const struct control_file *find_control(const char *path) {
+	if (path[CONTROL_DIR_LEN] != '/') {
+		return NULL;
+	}
+	for (size_t i = 0; i < CONTROL_FILES; i++) {
+		if (strcmp(path + CONTROL_DIR_LEN + 1, control_files[i].name) == 0) {
+			return &control_files[i];
+		}
+	}
+	return NULL;
 }
 
-int lfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-	printf("----------------lfs_write----------------\n");
-	printf("write: (path=%s)\n", path);
-
-	struct entry *e = (struct entry*) fi->fh;
-	if (e == NULL) {
-		printf("lfs_open: Entry not found\n");
+static int control_getattr(const char *path, struct stat *stbuf) {
+	const struct control_file *file;
+	memset(stbuf, 0, sizeof(struct stat));
+	if (path[CONTROL_DIR_LEN] == '\0') {
+		stbuf->st_mode = S_IFDIR | 0555;
+		stbuf->st_nlink = 2;
+	} else if ((file = find_control(path)) != NULL) {
+		//The size is not known before the file is opened; reads are
+		//direct, so readers go on until they get a short read.
+		stbuf->st_mode = S_IFREG | (file->show ? 0444 : 0644);
+		stbuf->st_nlink = 1;
+	} else {
 		return -ENOENT;
 	}
+	stbuf->st_atime = stbuf->st_mtime = stbuf->st_ctime = time(NULL);
+	return 0;
+}
 
-	//If the file is empty
-	if(e->data) {
-		free(e->data);
+static int control_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset) {
+	if (path[CONTROL_DIR_LEN] != '\0') {
+		return find_control(path) ? -ENOTDIR : -ENOENT;
 	}
+	//Offsets 1 and 2 are "." and "..", then one per file.
+	const char *fixed[] = { ".", ".." };
+	for (off_t i = offset; i < 2 + (off_t) CONTROL_FILES; i++) {
+		const char *name = i < 2 ? fixed[i] : control_files[i - 2].name;
+		if (filler(buf, name, NULL, i + 1, 0)) {
+			break;
+		}
+	}
+	return 0;
+}
 
-	//print buffer
-	printf("buf: %s\n", buf);
-
-	e->data = (char*) malloc(size);
-	memcpy(e->data, buf, size); 
-
-	//print e->data
-	printf("e->data: %s\n", e->data);
+static int control_open(const char *path, struct fuse_file_info *fi) {
+	const struct control_file *file = find_control(path);
+	if (file == NULL) {
+		return path[CONTROL_DIR_LEN] == '\0' ? -EISDIR : -ENOENT;
+	}
+	if ((fi->flags & O_ACCMODE) != O_RDONLY && file->show) {
+		return -EACCES;
+	}
+	struct control_handle *h = malloc(sizeof(struct control_handle) + CONTROL_BUF);
+	if (h == NULL) {
+		return -ENOMEM;
+	}
+	if (file->show) {
+		h->len = file->show(h->data, CONTROL_BUF);
+	} else if (file->int_value) {
+		h->len = snprintf(h->data, CONTROL_BUF, "%d\n", *file->int_value);
+	} else {
+		h->len = snprintf(h->data, CONTROL_BUF, "%g\n", *file->double_value);
+	}
+	fi->fh = (uintptr_t) h;
+	fi->direct_io = 1;
+	return 0;
+}
 
-	e->access_time = time(NULL);
-	e->modification_time = time(NULL);
-	e->file_size = size + offset;
-	
+static int control_read(char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	struct control_handle *h = (struct control_handle *) (uintptr_t) fi->fh;
+	if (offset >= (off_t) h->len) {
+		return 0;
+	}
+	if (size > h->len - offset) {
+		size = h->len - offset;
+	}
+	memcpy(buf, h->data + offset, size);
 	return size;
 }
 
-int lfs_truncate(const char* path, off_t size) {
-	printf("----------------lfs_truncate----------------\n");
-	printf("truncate: (path=%s)\n", path);
+//Set a tunable from one write of a number, e.g. echo 30 > snapshot_interval.
+static int control_write(const char *path, const char *buf, size_t size) {
+	const struct control_file *file = find_control(path);
+	char value[64];
+	char *end;
 
-	struct entry *e = get_entry(path);
-	if (e == NULL) {
-		printf("lfs_truncate: Entry not found\n");
-		return -ENOENT;
+	if (file == NULL || file->show) {
+		return -EBADF;
+	}
+	if (size >= sizeof(value)) {
+		return -EINVAL;
+	}
+	memcpy(value, buf, size);
+	value[size] = '\0';
+	double v = file->int_value ? strtol(value, &end, 0) : strtod(value, &end);
+	while (*end == ' ' || *end == '\n') {
+		end++;
+	}
+	if (end == value || *end != '\0' || v < file->min || v > file->max) {
+		return -EINVAL;
 	}
 
-	if (e->data == NULL) {
-		printf("lfs_truncate: No data found\n");
-		return -ENOENT;
+	if (file->int_value) {
+		*file->int_value = v;
+	} else {
+		*file->double_value = v;
 	}
+	lfs_log(LOG_INFO, LOG_META, "control value set (x1000)", path, v * 1000, 0);
+	if (file->changed) {
+		file->changed();
+	}
+	return size;
+}
 
-	//New buffer
-	char *new_buf = (char*) malloc(size);
-	memcpy(new_buf, e->data, size);
-	free(e->data);
+//Shells truncate before writing a value, there is nothing to truncate.
+static int control_truncate(const char *path) {
+	const struct control_file *file = find_control(path);
+	return file && !file->show ? 0 : -EPERM;
+}
 
-	e->data = new_buf;
-	e->file_size = size;
-	e->modification_time = time(NULL);
-	e->access_time = time(NULL);	
+static int control_release(struct fuse_file_info *fi) {
+	free((void *) (uintptr_t) fi->fh);
 	return 0;
-
 }
 
-int lfs_mkdir(const char *path, mode_t mode) {
-	printf("----------------lfs_mkdir----------------\n");
-	printf("mkdir: (path=%s)\n", path);
-	int index = find_empty_entry();
-	printf("index: %d \n", index);
-
-	entries[index] = calloc(sizeof(struct entry), 1);
-
-	if(!entries[index]){
-		return -ENOMEM;
+//Every callback goes through one of these: it takes fs_lock, shared if the
+//op only reads the tree, sends CONTROL_DIR to the control_ functions, and
+//counts the op and its latency, lock wait included, in the stats. The
+//other arguments are only for the op trace, see struct optrace_record.
+#define TIMED(op, shared, path, offset, size, call) \
+	TIMED_TRACE(op, shared, path, NULL, offset, size, 0, 0, call)
+#define TIMED_TRACE(op, shared, path, out_path, offset, size, out_offset, mode, call) do { \
+	uint64_t start = stats_now(); \
+	if (shared) { \
+		pthread_rwlock_rdlock(&fs_lock); \
+	} else { \
+		pthread_rwlock_wrlock(&fs_lock); \
+	} \
+	int64_t res = (call); \
+	pthread_rwlock_unlock(&fs_lock); \
+	stats_record(op, start, res); \
+	optrace_record(op, path, out_path, offset, size, out_offset, mode, start, res); \
+	return res; \
+} while (0)
+
+static int open_file(const char *path, struct fuse_file_info *fi) {
+	int res = lfs_open(path, fi);
+	if (!options.keep_cache) {
+		fi->keep_cache = 0;
 	}
+	return res;
+}
 
-	struct entry *e = entries[index];
-
-	e->name = get_entry_name(path);
-	e->path = get_parent_path(path);
-	e->full_path = malloc(strlen(path) + 1);
-	e->access_time = time(NULL);
-	e->modification_time = time(NULL);
-	if (e->full_path == NULL) {
- 	   free(e);
- 	   return -ENOMEM;
-	}
-	strcpy(e->full_path, path);
-	e->is_dir = true;
-	e->file_size = 0;
-	
-	// find empty entry and add it.
-	entries[index] = e;
-	printf("LFS_mkdir added entry: %s  on index: %d \n", entries[index]->name, index);
-
-	printf("Print all entries: \n\n\n");
-	print_entries();
-	printf("\n");
-	entries_count++;
-	return 0;
+static int op_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
+	TIMED(STAT_GETATTR, true, path, 0, 0, is_control(path) ? control_getattr(path, stbuf) : lfs_getattr(path, stbuf, fi));
 }
 
-//Function to delete a entry
-void delete_entry(const char *path) {
-	printf("----------------delete_entry----------------\n");
-	printf("delete_entry: (path=%s)\n", path);
-
-	//remove entry from entries array
-	for (int i = 0; i < MAX_ENTRIES; i++)
-	{
-		if(entries[i]) {
-			if (strcmp(entries[i]->full_path, path) == 0) {
-				free(entries[i]->name);
-				free(entries[i]->path);
-				free(entries[i]->full_path);
-				free(entries[i]);
-				entries[i] = NULL;
-			}
-		}
-	}
+static int op_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+	TIMED(STAT_READDIR, true, path, offset, 0, is_control(path) ? control_readdir(path, buf, filler, offset) : lfs_readdir(path, buf, filler, offset, fi, flags));
 }
 
-//Delete a directory
-int lfs_rmdir(const char *path) {
-	printf("----------------lfs_rmdir----------------\n");
-	printf("rmdir: (path=%s)\n", path);
-	struct entry *e = get_entry(path);
-	if (e == NULL) {
-		printf("lfs_rmdir: Entry not found\n");
-		return -ENOENT;
-	}
-	if (!e->is_dir) {
-		printf("lfs_rmdir: Entry is not a directory\n");
-		return -ENOTDIR;
-	}
-	//Delete entry
-	delete_entry(path);
-	entries_count--;
-	return 0;
+static int op_mknod(const char *path, mode_t mode, dev_t rdev) {
+	TIMED(STAT_MKNOD, false, path, 0, mode, is_control(path) ? -EPERM : lfs_mknod(path, mode, rdev));
 }
 
-int lfs_utime(const char *path, struct utimbuf *ubuf) {
-	printf("----------------lfs_utime----------------\n");
-	printf("utime: (path=%s)\n", path);
-	struct entry *e = get_entry(path);
-	if (e == NULL) {
-		printf("lfs_utime: Entry not found\n");
-		return -ENOENT;
-	}
-	//Update access and modification time
-	e->access_time = ubuf->actime;
-	e->modification_time = ubuf->modtime;
-	return 0;
+static int op_mkdir(const char *path, mode_t mode) {
+	TIMED(STAT_MKDIR, false, path, 0, mode, is_control(path) ? -EPERM : lfs_mkdir(path, mode));
 }
 
-int read_entries_from_file () {
-	printf("----------------read_entries_from_file----------------\n");
-	size_t bytes_read;
+static int op_unlink(const char *path) {
+	TIMED(STAT_UNLINK, false, path, 0, 0, is_control(path) ? -EPERM : lfs_unlink(path));
+}
 
-	//Read the numbers of entries from the file
-	bytes_read = fread(&entries_count, sizeof(int), 1, fp);
-	printf("Read entries_count: %d\n", entries_count);
+static int op_rmdir(const char *path) {
+	TIMED(STAT_RMDIR, false, path, 0, 0, is_control(path) ? -EPERM : lfs_rmdir(path));
+}
 
-	if(entries_count > MAX_ENTRIES) {
-		printf("Error: Too many entries in the file system\n");
-		return -1;
-	}
+static int op_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+	TIMED(STAT_TRUNCATE, false, path, 0, size, is_control(path) ? control_truncate(path) : lfs_truncate(path, size, fi));
+}
 
-	if(entries_count < 0) {
-		printf("Error: Invalid number of entries in the file system\n");
-		return -1;
-	}
+static int op_open(const char *path, struct fuse_file_info *fi) {
+	TIMED(STAT_OPEN, false, path, 0, fi->flags, is_control(path) ? control_open(path, fi) : open_file(path, fi));
+}
 
-	if(entries_count > 0) {
-		//Read the entries from the file
-		for (int i = 0; i < entries_count; i++) {
-			size_t size;
-			entries[i] = calloc(sizeof(struct entry), 1);
-			if (!entries[i]) {
-				printf("Error: Could not allocate memory\n");
-			}
+static int op_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	TIMED(STAT_READ, true, path, offset, size, is_control(path) ? control_read(buf, size, offset, fi) : lfs_read(path, buf, size, offset, fi));
+}
 
-			//Read full_path
-			bytes_read = fread(&size, sizeof(size_t), 1, fp);
-			entries[i]->full_path = calloc(sizeof(char), size);
-			if(!entries[i]->full_path){
-				return -ENOMEM;
-				printf("Error: Could not allocate memory\n");
-			}
+static int op_flush(const char *path, struct fuse_file_info *fi) {
+	TIMED(STAT_FLUSH, false, path, 0, 0, is_control(path) ? 0 : lfs_flush(path, fi));
+}
 
-			bytes_read = fread(entries[i]->full_path, size, 1, fp);
-			printf("Read full_path: %s\n", entries[i]->full_path);
+static int op_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	TIMED(STAT_FSYNC, false, path, 0, datasync, is_control(path) ? 0 : lfs_fsync(path, datasync, fi));
+}
 
-			entries[i]->name = calloc(sizeof(char), size);
-			entries[i]->path = calloc(sizeof(char), size);
-			entries[i]->name = get_entry_name(entries[i]->full_path);
-			entries[i]->path = get_parent_path(entries[i]->full_path);
+static int op_release(const char *path, struct fuse_file_info *fi) {
+	TIMED(STAT_RELEASE, false, path, 0, 0, is_control(path) ? control_release(fi) : lfs_release(path, fi));
+}
 
-			printf("THE NAME IS: %s\n", entries[i]->name);
+static int op_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	TIMED(STAT_WRITE, false, path, offset, size, is_control(path) ? control_write(path, buf, size) : lfs_write(path, buf, size, offset, fi));
+}
 
-			bytes_read = fread(&entries[i]->is_dir, sizeof(bool), 1, fp);
-			bytes_read = fread(&entries[i]->access_time, sizeof(time_t), 1, fp);
-			bytes_read = fread(&entries[i]->modification_time, sizeof(time_t), 1, fp);
+static int op_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi) {
+	TIMED(STAT_UTIMENS, false, path, tv[0].tv_sec, tv[1].tv_sec, is_control(path) ? -EPERM : lfs_utimens(path, tv, fi));
+}
 
-			if (!entries[i]->is_dir) {
-				bytes_read = fread(&entries[i]->file_size, sizeof(int), 1, fp);
-				entries[i]->data = calloc(sizeof(char), entries[i]->file_size);
-				bytes_read = fread(entries[i]->data, sizeof(char), entries[i]->file_size, fp);
-			}
-		}
-	}
-	fclose(fp);
-	return 0;
+static off_t op_lseek(const char *path, off_t offset, int whence, struct fuse_file_info *fi) {
+	TIMED(STAT_LSEEK, true, path, offset, whence, is_control(path) ? -EINVAL : lfs_lseek(path, offset, whence, fi));
 }
 
-//Method that writes the entries to the file
-int write_entries_to_file (bool running) {
-	printf("----------------write_entries_to_file----------------\n");
-	printf("Write entries to file\n");
-	fwrite(&entries_count, sizeof(int), 1, fp);
+static int op_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+	TIMED_TRACE(STAT_FALLOCATE, false, path, NULL, offset, length, 0, mode,
+		is_control(path) ? -EPERM : lfs_fallocate(path, mode, offset, length, fi));
+}
 
-	for (int i = 0; i < entries_count; i++) {
+//The kernel copies control files with reads and writes instead.
+static ssize_t op_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t offset_in,
+		const char *path_out, struct fuse_file_info *fi_out, off_t offset_out, size_t size, int flags) {
+	TIMED_TRACE(STAT_COPY_FILE_RANGE, false, path_in, path_out, offset_in, size, offset_out, 0,
+		is_control(path_in) || is_control(path_out) ? -EOPNOTSUPP :
+		lfs_copy_file_range(path_in, fi_in, offset_in, path_out, fi_out, offset_out, size, flags));
+}
 
-		size_t size = strlen(entries[i]->full_path);
-		fwrite(&size, sizeof(size_t), 1, fp);
-		fwrite(entries[i]->full_path, sizeof(char), size, fp);
+static int op_statfs(const char *path, struct statvfs *st) {
+	TIMED(STAT_STATFS, true, path, 0, 0, lfs_statfs(path, st));
+}
 
-		fwrite(&entries[i]->is_dir, sizeof(bool), 1, fp);
-		fwrite(&entries[i]->access_time, sizeof(time_t), 1, fp);
-		fwrite(&entries[i]->modification_time, sizeof(time_t), 1, fp);
+static struct fuse_operations lfs_oper = {
+	.init = lfs_init,
+	.destroy = lfs_destroy,
+	.getattr	= op_getattr,
+	.readdir	= op_readdir,
+	.mknod = op_mknod,
+	.mkdir = op_mkdir,
+	.unlink = op_unlink,
+	.rmdir = op_rmdir,
+	.truncate = op_truncate,
+	.open	= op_open,
+	.read	= op_read,
+	.flush = op_flush,
+	.fsync = op_fsync,
+	.release = op_release,
+	.lseek = op_lseek,
+	.fallocate = op_fallocate,
+	.copy_file_range = op_copy_file_range,
+	.statfs = op_statfs,
+	.write = op_write,
+	.rename = NULL,
+	.utimens = op_utimens
+};
 
-		if(!entries[i]->is_dir) {
-			fwrite(&entries[i]->file_size, sizeof(int), 1, fp);
-			fwrite(entries[i]->data, sizeof(char), entries[i]->file_size, fp);
+//First non-option argument is the mount point, the second is the image file.
+static int lfs_opt_proc(void *data, const char *arg, int key, struct fuse_args *outargs) {
+	if (key == FUSE_OPT_KEY_NONOPT) {
+		if (options.mountpoint == NULL) {
+			options.mountpoint = strdup(arg);
+			return 1;
 		}
-		if (!running) {
-			free(entries[i]->name);
-			free(entries[i]->path);
-			free(entries[i]->full_path);
-			free(entries[i]);
+		if (options.image == NULL) {
+			options.image = strdup(arg);
+			return 0;
 		}
 	}
-	fclose(fp);
-	return 0;
+	return 1;
 }
 
 int main( int argc, char *argv[] ) {
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
-	// Initialize the entries array to NULL pointers
-    memset(entries, 0, MAX_ENTRIES * sizeof(struct entry*));
+	if (core_init() != 0) {
+		return -1;
+	}
 
-	fp = fopen(argv[4], "rb");
+	if (fuse_opt_parse(&args, &options, lfs_opts, lfs_opt_proc) == -1) {
+		return -1;
+	}
+	if (options.image == NULL) {
+		printf("usage: %s [options] <mountpoint> <image>\n", argv[0]);
+		return -1;
+	}
+	if (options.hugepages) {
+		block_use_hugepages();
+	}
+	if (options.write_buffer < 0 || options.write_buffer > 1 << 16 || options.write_buffers < 0) {
+		printf("Error: write_buffer must be 0 to 65536 KiB, write_buffers at least 0\n");
+		return -1;
+	}
+	write_buffer = options.write_buffer;
+	write_buffers = options.write_buffers;
+
+	FILE *fp = fopen(options.image, "rb");
 
 	if (!fp) {
 		printf("Error: File not found\n");
 		return -1;
 	}
 
-	read_entries_from_file();
-
-	printf("Successfully read entries from file\n");
-
-	pid_t pid;
-	pid = fork();
-
-	if (pid < 0) {
-		printf("Error: Could not fuck\n");
+	// A damaged image is not mounted empty, the first snapshot would replace it.
+	// The load closes fp.
+	if (read_entries_from_file(fp) != 0) {
+		printf("Error: Could not load image %s\n", options.image);
+		fuse_opt_free_args(&args);
 		return -1;
 	}
-	else if (pid == 0) {
-		while(true)	{
-			write_entries_to_file(true);
-			sleep(20);
-		}
-	}
 
 	// Initialize the FUSE operations
-	fuse_main(4, argv, &lfs_oper);
+	fuse_main(args.argc, args.argv, &lfs_oper, NULL);
+	fuse_opt_free_args(&args);
 
-	// Write the entries to the file
-	fp = fopen(argv[4], "wb");
-	write_entries_to_file(false);
+	// Write the entries to the file, with what files left open still held
+	if (flush_handles() != 0) {
+		lfs_log(LOG_ERROR, LOG_PERSIST, "writes lost, out of memory", NULL, 0, 0);
+	}
+	if (store_image(options.image, false) != 0) {
+		printf("Error: Could not save image\n");
+		return -1;
+	}
 
 	return 0;
 }
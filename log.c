@@ -0,0 +1,170 @@
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "threadslot.h"
+
+// Records kept per thread, about 384 KiB.
+#define RING_SIZE 4096
+#define PATH_KEPT 46
+
+int log_level = LFS_LOG_LEVEL;
+int log_categories = LOG_ALL;
+
+// seq is index + 1 of the record in its ring. It is cleared while the
+// record is written, so a dump can tell a record it raced with.
+struct log_record {
+	uint64_t seq;
+	uint64_t ns;
+	const char *msg;
+	int64_t a;
+	int64_t b;
+	int32_t tid;
+	uint8_t level;
+	uint8_t cat;
+	char path[PATH_KEPT];
+};
+
+struct log_ring {
+	struct thread_slot slot;
+	int32_t tid;
+	uint64_t head;
+	struct log_record rec[RING_SIZE];
+};
+
+// A thread that starts logging takes over the ring of one that exited,
+// older records and all, so they can still be dumped.
+static struct thread_slots rings = THREAD_SLOTS_INIT(struct log_ring);
+static __thread void *my_ring;
+
+static const char *level_names[] = { "-", "ERROR", "INFO", "DEBUG", "TRACE" };
+
+void log_record(int level, int cat, const char *msg, const char *path, int64_t a, int64_t b) {
+	struct log_ring *ring = my_ring;
+	if (ring == NULL) {
+		ring = thread_slot_get(&rings, &my_ring);
+		if (ring == NULL) {
+			return;
+		}
+		ring->tid = syscall(SYS_gettid);
+	}
+
+	uint64_t head = ring->head;
+	struct log_record *r = &ring->rec[head % RING_SIZE];
+	struct timespec ts;
+
+	__atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	r->ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	r->msg = msg;
+	r->a = a;
+	r->b = b;
+	r->tid = ring->tid;
+	r->level = level;
+	r->cat = cat;
+	if (path) {
+		strncpy(r->path, path, PATH_KEPT - 1);
+		r->path[PATH_KEPT - 1] = '\0';
+	} else {
+		r->path[0] = '\0';
+	}
+	__atomic_store_n(&r->seq, head + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int compare_time(const void *a, const void *b) {
+	const struct log_record *x = a, *y = b;
+	return x->ns < y->ns ? -1 : x->ns > y->ns;
+}
+
+void log_dump(FILE *out) {
+	size_t cap = 0, n = 0;
+	struct log_record *all = NULL;
+
+	for (struct thread_slot *slot = thread_slot_first(&rings); slot; slot = slot->next) {
+		struct log_ring *ring = (struct log_ring *) slot;
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t start = head > RING_SIZE ? head - RING_SIZE : 0;
+		for (uint64_t i = start; i < head; i++) {
+			if (n == cap) {
+				cap = cap ? cap * 2 : RING_SIZE;
+				struct log_record *grown = realloc(all, cap * sizeof(struct log_record));
+				if (grown == NULL) {
+					goto out;
+				}
+				all = grown;
+			}
+			struct log_record *r = &ring->rec[i % RING_SIZE];
+			if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != i + 1) {
+				continue;
+			}
+			memcpy(&all[n], r, sizeof(struct log_record));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			//Overwritten while we copied it.
+			if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) != i + 1) {
+				continue;
+			}
+			n++;
+		}
+	}
+
+out:
+	qsort(all, n, sizeof(struct log_record), compare_time);
+	for (size_t i = 0; i < n; i++) {
+		struct log_record *r = &all[i];
+		fprintf(out, "%llu.%09llu %d %-5s %02x %s %s %lld %lld\n",
+			(unsigned long long) (r->ns / 1000000000ULL), (unsigned long long) (r->ns % 1000000000ULL),
+			r->tid, r->level <= LOG_TRACE ? level_names[r->level] : "?", r->cat,
+			r->msg, r->path[0] ? r->path : "-", (long long) r->a, (long long) r->b);
+	}
+	fflush(out);
+	free(all);
+}
+
+static sem_t dump_sem;
+static char *dump_path;
+
+static void on_sigusr2(int sig) {
+	sem_post(&dump_sem);
+}
+
+static void *dumper_main(void *arg) {
+	for (;;) {
+		while (sem_wait(&dump_sem) != 0) {
+		}
+		FILE *out = fopen(dump_path, "a");
+		if (out) {
+			log_dump(out);
+			fclose(out);
+		}
+	}
+	return NULL;
+}
+
+int log_start_dumper(const char *path) {
+	pthread_t thread;
+	struct sigaction sa;
+
+	dump_path = strdup(path);
+	if (dump_path == NULL || sem_init(&dump_sem, 0, 0) != 0) {
+		return -1;
+	}
+	if (pthread_create(&thread, NULL, dumper_main, NULL) != 0) {
+		return -1;
+	}
+	pthread_detach(thread);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_sigusr2;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	return sigaction(SIGUSR2, &sa, NULL);
+}
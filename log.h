@@ -0,0 +1,52 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Trace logging.
+//
+// lfs_log() compiles to nothing unless the build sets LFS_LOG_LEVEL
+// (make LOG_LEVEL=4). When compiled in, a call writes one fixed-size binary
+// record into a ring buffer owned by the calling thread: no formatting, no
+// locks and no system calls. Records are only formatted when the rings are
+// dumped, on SIGUSR2 or at unmount.
+
+#define LOG_ERROR 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+#define LOG_TRACE 4
+
+#define LOG_META 0x01		// lookups, create, remove, attributes
+#define LOG_DATA 0x02		// read, write, truncate
+#define LOG_DIR 0x04		// directory listings
+#define LOG_PERSIST 0x08	// image load and save
+#define LOG_CACHE 0x10		// kernel cache setup and invalidation
+#define LOG_ALL 0xff
+
+#ifndef LFS_LOG_LEVEL
+#define LFS_LOG_LEVEL 0
+#endif
+
+// Runtime filters, only records that pass both are kept.
+extern int log_level;
+extern int log_categories;
+
+// msg must be a string literal, only its address is recorded. path is
+// copied, truncated if long, and may be NULL. a and b are two numbers that
+// go with the message.
+#define lfs_log(level, cat, msg, path, a, b) do { \
+	if (LFS_LOG_LEVEL >= (level) && (level) <= log_level && (log_categories & (cat))) { \
+		log_record((level), (cat), (msg), (path), (int64_t) (a), (int64_t) (b)); \
+	} \
+} while (0)
+
+void log_record(int level, int cat, const char *msg, const char *path, int64_t a, int64_t b);
+
+// Write every record still in the rings to out, oldest first.
+void log_dump(FILE *out);
+
+// Append a dump to the file at path whenever the process gets SIGUSR2.
+int log_start_dumper(const char *path);
+
+#endif
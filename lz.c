@@ -0,0 +1,150 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define MIN_MATCH 4
+#define HASH_BITS 10
+#define MAX_OFFSET 65535
+
+static inline uint32_t read32(const char *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline unsigned hash4(uint32_t v) {
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+//Write the part of a length that does not fit in its nibble.
+static char *put_len(char *op, size_t len) {
+	for (; len >= 255; len -= 255) {
+		*op++ = (char) 255;
+	}
+	*op++ = (char) len;
+	return op;
+}
+
+//Room a sequence with lit literals and a match of extra bytes over
+//MIN_MATCH can take at most.
+static size_t seq_size(size_t lit, size_t extra) {
+	return 1 + lit / 255 + 1 + lit + 2 + extra / 255 + 1;
+}
+
+static char *put_seq(char *op, const char *lit, size_t nlit, size_t offset, size_t extra, int last) {
+	char *token = op++;
+	*token = (char) ((nlit < 15 ? nlit : 15) << 4);
+	if (nlit >= 15) {
+		op = put_len(op, nlit - 15);
+	}
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (last) {
+		return op;
+	}
+	*token |= extra < 15 ? extra : 15;
+	*op++ = (char) (offset & 0xff);
+	*op++ = (char) (offset >> 8);
+	if (extra >= 15) {
+		op = put_len(op, extra - 15);
+	}
+	return op;
+}
+
+size_t lz_compress(const char *src, size_t n, char *dst, size_t cap) {
+	uint16_t table[1 << HASH_BITS];
+	const char *ip = src, *anchor = src, *end = src + n;
+	char *op = dst;
+
+	memset(table, 0, sizeof(table));
+	while (ip + MIN_MATCH <= end) {
+		uint32_t v = read32(ip);
+		unsigned h = hash4(v);
+		const char *ref = src + table[h];
+		table[h] = ip - src;
+		if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != v) {
+			ip++;
+			continue;
+		}
+
+		const char *m = ip + MIN_MATCH, *r = ref + MIN_MATCH;
+		while (m < end && *m == *r) {
+			m++;
+			r++;
+		}
+		size_t nlit = ip - anchor, extra = m - ip - MIN_MATCH;
+		if ((size_t) (op - dst) + seq_size(nlit, extra) > cap) {
+			return 0;
+		}
+		op = put_seq(op, anchor, nlit, ip - ref, extra, 0);
+		ip = anchor = m;
+	}
+
+	size_t nlit = end - anchor;
+	if ((size_t) (op - dst) + seq_size(nlit, 0) > cap) {
+		return 0;
+	}
+	op = put_seq(op, anchor, nlit, 0, 0, 1);
+	return op - dst;
+}
+
+//Read the rest of a length whose nibble was 15.
+static int get_len(const unsigned char **ip, const unsigned char *end, size_t *len) {
+	unsigned char c;
+	do {
+		if (*ip >= end) {
+			return -1;
+		}
+		c = *(*ip)++;
+		*len += c;
+	} while (c == 255);
+	return 0;
+}
+
+long lz_decompress(const char *src, size_t n, char *dst, size_t cap) {
+	const unsigned char *ip = (const unsigned char *) src, *end = ip + n;
+	char *op = dst, *oend = dst + cap;
+
+	while (ip < end) {
+		unsigned token = *ip++;
+		size_t nlit = token >> 4;
+		if (nlit == 15 && get_len(&ip, end, &nlit) != 0) {
+			return -1;
+		}
+		if (nlit > (size_t) (end - ip) || nlit > (size_t) (oend - op)) {
+			return -1;
+		}
+		memcpy(op, ip, nlit);
+		ip += nlit;
+		op += nlit;
+		if (ip == end) {
+			break;
+		}
+
+		if (end - ip < 2) {
+			return -1;
+		}
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		size_t len = token & 15;
+		if (len == 15 && get_len(&ip, end, &len) != 0) {
+			return -1;
+		}
+		len += MIN_MATCH;
+		if (offset == 0 || offset > (size_t) (op - dst) || len > (size_t) (oend - op)) {
+			return -1;
+		}
+		//A match may overlap what it produces, that needs a byte at a time.
+		const char *ref = op - offset;
+		if (offset >= len) {
+			memcpy(op, ref, len);
+		} else {
+			for (size_t i = 0; i < len; i++) {
+				op[i] = ref[i];
+			}
+		}
+		op += len;
+	}
+	return op - dst;
+}
@@ -0,0 +1,25 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+// A small LZ77 codec for file blocks, in the spirit of LZ4: greedy matching
+// through a hash of the next four bytes, no entropy coding. It compresses
+// text and sparse data well enough and decodes at memory speed.
+//
+// The output is a list of sequences. Each starts with a token byte whose
+// high nibble is the number of literals and low nibble the match length
+// minus 4; a nibble of 15 is followed by more length bytes, 255 meaning that
+// another byte follows. Then come the literals, and unless this is the last
+// sequence, a two byte little endian offset back to the match. Inputs are at
+// most 64 KiB.
+
+// Compress n bytes of src into dst. Returns the compressed length, or 0 if
+// it would take more than cap bytes.
+size_t lz_compress(const char *src, size_t n, char *dst, size_t cap);
+
+// Decompress n bytes of src into dst. Returns the length of the output, or
+// -1 if src is damaged or the output would take more than cap bytes.
+long lz_decompress(const char *src, size_t n, char *dst, size_t cap);
+
+#endif
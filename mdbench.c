@@ -0,0 +1,234 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// Metadata benchmark in the style of mdtest, run against a mounted lfs (or
+// any other directory, for comparison).
+//
+//     ./mdbench [-t threads] [-d dirs] [-n files] [-w | -D] <dir>
+//
+// Each thread builds a tree of its own under <dir>: with -w (the default)
+// its dirs sit side by side, with -D each is inside the one before. The
+// thread's files are spread over its dirs. All threads run each phase
+// together, and the phase is timed from the first thread starting it to the
+// last one finishing.
+//
+// Output is one line per phase, "phase ops seconds ops/s", preceded by a
+// line with the settings. The format is kept stable so results can be
+// compared between runs and versions.
+
+static int nthreads = 1;
+static int ndirs = 10;
+static int nfiles = 1000;
+static int deep;
+static const char *root;
+
+enum phase {
+	DIR_CREATE,
+	FILE_CREATE,
+	FILE_STAT,
+	DIR_LIST,
+	FILE_UNLINK,
+	DIR_REMOVE,
+	PHASES
+};
+
+static const char *phase_names[PHASES] = {
+	"dir_create", "file_create", "file_stat", "dir_list", "file_unlink", "dir_remove",
+};
+
+static pthread_barrier_t barrier;
+static double phase_start[PHASES];
+static double phase_end[PHASES];
+static long phase_ops[PHASES];
+static pthread_mutex_t ops_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what, const char *path) {
+	fprintf(stderr, "%s %s: %s\n", what, path, strerror(errno));
+	exit(1);
+}
+
+//Path of dir d of thread t; with deep trees each dir is inside the last.
+static int dir_path(char *buf, size_t size, int t, int d) {
+	int len = snprintf(buf, size, "%s/t%d", root, t);
+	if (!deep) {
+		return len + snprintf(buf + len, size - len, "/d%d", d);
+	}
+	for (int i = 0; i <= d; i++) {
+		len += snprintf(buf + len, size - len, "/d%d", i);
+	}
+	return len;
+}
+
+static void file_path(char *buf, size_t size, int t, int f) {
+	int len = dir_path(buf, size, t, f % ndirs);
+	snprintf(buf + len, size - len, "/f%d", f);
+}
+
+static long run_phase(enum phase p, int t) {
+	char path[PATH_MAX];
+	struct stat st;
+	long ops = 0;
+
+	switch (p) {
+	case DIR_CREATE:
+		for (int d = 0; d < ndirs; d++, ops++) {
+			dir_path(path, sizeof(path), t, d);
+			if (mkdir(path, 0755) != 0) {
+				fail("mkdir", path);
+			}
+		}
+		break;
+	case FILE_CREATE:
+		for (int f = 0; f < nfiles; f++, ops++) {
+			file_path(path, sizeof(path), t, f);
+			int fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+			if (fd < 0) {
+				fail("create", path);
+			}
+			close(fd);
+		}
+		break;
+	case FILE_STAT:
+		for (int f = 0; f < nfiles; f++, ops++) {
+			file_path(path, sizeof(path), t, f);
+			if (stat(path, &st) != 0) {
+				fail("stat", path);
+			}
+		}
+		break;
+	case DIR_LIST:
+		//One op per name returned.
+		for (int d = 0; d < ndirs; d++) {
+			dir_path(path, sizeof(path), t, d);
+			DIR *dir = opendir(path);
+			if (dir == NULL) {
+				fail("opendir", path);
+			}
+			while (readdir(dir) != NULL) {
+				ops++;
+			}
+			closedir(dir);
+		}
+		break;
+	case FILE_UNLINK:
+		for (int f = 0; f < nfiles; f++, ops++) {
+			file_path(path, sizeof(path), t, f);
+			if (unlink(path) != 0) {
+				fail("unlink", path);
+			}
+		}
+		break;
+	case DIR_REMOVE:
+		//Innermost first, so deep trees come apart.
+		for (int d = ndirs - 1; d >= 0; d--, ops++) {
+			dir_path(path, sizeof(path), t, d);
+			if (rmdir(path) != 0) {
+				fail("rmdir", path);
+			}
+		}
+		break;
+	default:
+		break;
+	}
+	return ops;
+}
+
+static void *worker(void *arg) {
+	int t = (intptr_t) arg;
+	for (int p = 0; p < PHASES; p++) {
+		//The barrier's serial thread stamps the start and end of a phase.
+		if (pthread_barrier_wait(&barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+			phase_start[p] = now();
+		}
+		pthread_barrier_wait(&barrier);
+		long ops = run_phase(p, t);
+		pthread_mutex_lock(&ops_lock);
+		phase_ops[p] += ops;
+		pthread_mutex_unlock(&ops_lock);
+		if (pthread_barrier_wait(&barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+			phase_end[p] = now();
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	while ((opt = getopt(argc, argv, "t:d:n:wD")) != -1) {
+		switch (opt) {
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'd':
+			ndirs = atoi(optarg);
+			break;
+		case 'n':
+			nfiles = atoi(optarg);
+			break;
+		case 'w':
+			deep = 0;
+			break;
+		case 'D':
+			deep = 1;
+			break;
+		default:
+			optind = argc + 1;
+			break;
+		}
+	}
+	if (optind != argc - 1 || nthreads <= 0 || ndirs <= 0 || nfiles < 0) {
+		fprintf(stderr, "usage: %s [-t threads] [-d dirs] [-n files per thread] [-w | -D] <dir>\n", argv[0]);
+		return 1;
+	}
+	root = argv[optind];
+
+	char path[PATH_MAX];
+	for (int t = 0; t < nthreads; t++) {
+		snprintf(path, sizeof(path), "%s/t%d", root, t);
+		if (mkdir(path, 0755) != 0) {
+			fail("mkdir", path);
+		}
+	}
+
+	pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+	pthread_barrier_init(&barrier, NULL, nthreads);
+	for (int t = 0; t < nthreads; t++) {
+		if (pthread_create(&threads[t], NULL, worker, (void *) (intptr_t) t) != 0) {
+			fprintf(stderr, "could not start thread %d\n", t);
+			return 1;
+		}
+	}
+	for (int t = 0; t < nthreads; t++) {
+		pthread_join(threads[t], NULL);
+	}
+
+	for (int t = 0; t < nthreads; t++) {
+		snprintf(path, sizeof(path), "%s/t%d", root, t);
+		rmdir(path);
+	}
+
+	printf("# mdbench threads=%d dirs=%d files=%d tree=%s\n", nthreads, ndirs, nfiles, deep ? "deep" : "wide");
+	for (int p = 0; p < PHASES; p++) {
+		double secs = phase_end[p] - phase_start[p];
+		printf("%-12s %10ld %10.4f %12.0f\n", phase_names[p], phase_ops[p], secs,
+			secs > 0 ? phase_ops[p] / secs : 0.0);
+	}
+	free(threads);
+	return 0;
+}
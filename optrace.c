@@ -0,0 +1,82 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "optrace.h"
+
+// Records are small, a big stdio buffer keeps writes to the trace rare.
+#define TRACE_BUF (1 << 20)
+
+bool optrace_enabled;
+
+static FILE *trace;
+static uint64_t trace_start;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int optrace_open(const char *path) {
+	struct optrace_header header = {
+		.magic = OPTRACE_MAGIC,
+		.version = OPTRACE_VERSION,
+		.record_size = sizeof(struct optrace_record),
+	};
+
+	FILE *out = fopen(path, "wb");
+	if (out == NULL) {
+		return -errno;
+	}
+	setvbuf(out, NULL, _IOFBF, TRACE_BUF);
+	if (fwrite(&header, sizeof(header), 1, out) != 1) {
+		fclose(out);
+		return -EIO;
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	trace = out;
+	trace_start = stats_now();
+	__atomic_store_n(&optrace_enabled, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&trace_lock);
+	return 0;
+}
+
+void optrace_close(void) {
+	pthread_mutex_lock(&trace_lock);
+	__atomic_store_n(&optrace_enabled, false, __ATOMIC_RELEASE);
+	if (trace) {
+		fclose(trace);
+		trace = NULL;
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void optrace_record(enum stat_op op, const char *path, const char *out_path, int64_t offset, int64_t size,
+		int64_t out_offset, int mode, uint64_t start, int64_t result) {
+	if (!__atomic_load_n(&optrace_enabled, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	uint64_t latency = stats_now() - start;
+	size_t len = path ? strnlen(path, UINT16_MAX) : 0;
+	size_t out_len = out_path ? strnlen(out_path, UINT16_MAX - 1 - len) : 0;
+	struct optrace_record rec = {
+		.latency_ns = latency > UINT32_MAX ? UINT32_MAX : latency,
+		.op = op,
+		.mode = mode,
+		.path_len = len + (out_path ? 1 + out_len : 0),
+		.result = result,
+		.offset = offset,
+		.size = size,
+		.out_offset = out_offset,
+	};
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace) {
+		rec.start_ns = start > trace_start ? start - trace_start : 0;
+		fwrite(&rec, sizeof(rec), 1, trace);
+		fwrite(path, 1, len, trace);
+		if (out_path) {
+			fwrite("", 1, 1, trace);
+			fwrite(out_path, 1, out_len, trace);
+		}
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,55 @@
+#ifndef OPTRACE_H
+#define OPTRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+// Binary trace of every callback, for replaying a real workload later.
+//
+// A trace is a struct optrace_header followed by records, each a struct
+// optrace_record and then path_len bytes of path without a terminator. For
+// copy_file_range the path is the source, a zero byte and the destination.
+// Records are written as ops finish, so they are only roughly in start
+// order. All fields are in host byte order.
+
+#define OPTRACE_MAGIC 0x31435254534f464cULL	// "LFOSTRC1"
+#define OPTRACE_VERSION 3
+
+struct optrace_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t record_size;
+};
+
+struct optrace_record {
+	uint64_t start_ns;	// since the trace was opened
+	uint32_t latency_ns;	// saturates at 4.29 s
+	uint8_t op;		// enum stat_op
+	uint8_t mode;		// the mode of fallocate
+	uint16_t path_len;
+	int64_t result;
+	// what each op was asked: the offset of read, write and readdir; the
+	// size of read, write and truncate; the mode of mknod and mkdir; the
+	// open flags; the atime and mtime seconds of utimens; the offset and
+	// whence of lseek; the offset and length of fallocate; the source
+	// offset and length of copy_file_range.
+	int64_t offset;
+	int64_t size;
+	// the destination offset of copy_file_range
+	int64_t out_offset;
+};
+
+extern bool optrace_enabled;
+
+// Start writing a trace to path. Returns 0 or -errno.
+int optrace_open(const char *path);
+void optrace_close(void);
+
+// Add one op that started at start (stats_now time) and returned result.
+// out_path and out_offset are only for copy_file_range, NULL and 0 otherwise.
+void optrace_record(enum stat_op op, const char *path, const char *out_path, int64_t offset, int64_t size,
+	int64_t out_offset, int mode, uint64_t start, int64_t result);
+
+#endif
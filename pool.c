@@ -0,0 +1,223 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+// Objects a thread keeps for itself, and how many it trades at a time.
+#define CACHE_MAX 64
+#define CACHE_BATCH 32
+
+// Slabs are at least this big, and page aligned.
+#define SLAB_MIN (64 * 1024)
+#define SLAB_ALIGN 4096
+
+// Size classes for strings.
+#define STR_CLASSES 5
+static const size_t str_sizes[STR_CLASSES] = { 16, 32, 64, 128, 256 };
+static const char *str_names[STR_CLASSES] = { "str16", "str32", "str64", "str128", "str256" };
+static struct pool str_pools[STR_CLASSES];
+static pthread_once_t str_once = PTHREAD_ONCE_INIT;
+
+static struct pool *pools[POOL_MAX];
+static int pool_count;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct cache {
+	void *head;
+	int count;
+};
+
+static __thread struct cache caches[POOL_MAX];
+static __thread bool cache_registered;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+void pool_init(struct pool *p, const char *name, size_t size) {
+	memset(p, 0, sizeof(struct pool));
+	p->name = name;
+	//Objects hold the free list link and stay 8 byte aligned.
+	p->size = size < sizeof(void *) ? sizeof(void *) : (size + 7) & ~(size_t) 7;
+	p->slab_size = p->size * CACHE_BATCH * 4;
+	if (p->slab_size < SLAB_MIN) {
+		p->slab_size = SLAB_MIN;
+	}
+	pthread_mutex_init(&p->lock, NULL);
+
+	pthread_mutex_lock(&pools_lock);
+	p->id = pool_count;
+	pools[pool_count++] = p;
+	pthread_mutex_unlock(&pools_lock);
+}
+
+//Give count objects from the list at head back to the shared free list.
+static void give_back(struct pool *p, void *head, void *tail, int count) {
+	pthread_mutex_lock(&p->lock);
+	*(void **) tail = p->free;
+	p->free = head;
+	p->free_count += count;
+	pthread_mutex_unlock(&p->lock);
+}
+
+//Return everything cached by an exiting thread.
+static void flush_caches(void *arg) {
+	for (int i = 0; i < pool_count; i++) {
+		struct cache *c = &caches[i];
+		if (c->head == NULL) {
+			continue;
+		}
+		void *tail = c->head;
+		while (*(void **) tail) {
+			tail = *(void **) tail;
+		}
+		give_back(pools[i], c->head, tail, c->count);
+		c->head = NULL;
+		c->count = 0;
+	}
+}
+
+static void make_cache_key(void) {
+	pthread_key_create(&cache_key, flush_caches);
+}
+
+//Have the caches of this thread flushed when it exits. Objects reach a
+//cache through pool_put as well as refill.
+static inline void register_caches(void) {
+	if (!cache_registered) {
+		pthread_once(&cache_once, make_cache_key);
+		pthread_setspecific(cache_key, caches);
+		cache_registered = true;
+	}
+}
+
+//Move up to CACHE_BATCH objects from the pool into the thread cache.
+static void refill(struct pool *p, struct cache *c) {
+	register_caches();
+
+	pthread_mutex_lock(&p->lock);
+	while (c->count < CACHE_BATCH && p->free) {
+		void *obj = p->free;
+		p->free = *(void **) obj;
+		p->free_count--;
+		*(void **) obj = c->head;
+		c->head = obj;
+		c->count++;
+	}
+	while (c->count < CACHE_BATCH) {
+		if (p->bump + p->size > p->bump_end) {
+			void *slab;
+			if (posix_memalign(&slab, SLAB_ALIGN, p->slab_size) != 0) {
+				break;
+			}
+			p->bump = slab;
+			p->bump_end = p->bump + p->slab_size;
+			p->slabs++;
+		}
+		void *obj = p->bump;
+		p->bump += p->size;
+		*(void **) obj = c->head;
+		c->head = obj;
+		c->count++;
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+void *pool_get(struct pool *p) {
+	struct cache *c = &caches[p->id];
+	if (c->head == NULL) {
+		refill(p, c);
+		if (c->head == NULL) {
+			return NULL;
+		}
+	}
+	void *obj = c->head;
+	c->head = *(void **) obj;
+	c->count--;
+	__atomic_add_fetch(&p->in_use, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&p->allocs, 1, __ATOMIC_RELAXED);
+	return obj;
+}
+
+void pool_put(struct pool *p, void *obj) {
+	if (obj == NULL) {
+		return;
+	}
+	register_caches();
+	struct cache *c = &caches[p->id];
+	*(void **) obj = c->head;
+	c->head = obj;
+	c->count++;
+	__atomic_sub_fetch(&p->in_use, 1, __ATOMIC_RELAXED);
+
+	if (c->count > CACHE_MAX) {
+		void *head = c->head;
+		void *tail = head;
+		for (int i = 1; i < CACHE_BATCH; i++) {
+			tail = *(void **) tail;
+		}
+		c->head = *(void **) tail;
+		c->count -= CACHE_BATCH;
+		give_back(p, head, tail, CACHE_BATCH);
+	}
+}
+
+static void init_str_pools(void) {
+	for (int i = 0; i < STR_CLASSES; i++) {
+		pool_init(&str_pools[i], str_names[i], str_sizes[i]);
+	}
+}
+
+static struct pool *str_pool(size_t size) {
+	pthread_once(&str_once, init_str_pools);
+	for (int i = 0; i < STR_CLASSES; i++) {
+		if (size <= str_sizes[i]) {
+			return &str_pools[i];
+		}
+	}
+	return NULL;
+}
+
+char *pool_strndup(const char *s, size_t n) {
+	size_t len = strnlen(s, n);
+	struct pool *p = str_pool(len + 1);
+	char *copy = p ? pool_get(p) : malloc(len + 1);
+	if (copy) {
+		memcpy(copy, s, len);
+		copy[len] = '\0';
+	}
+	return copy;
+}
+
+char *pool_strdup(const char *s) {
+	return pool_strndup(s, strlen(s));
+}
+
+void pool_free_str(char *s) {
+	if (s == NULL) {
+		return;
+	}
+	struct pool *p = str_pool(strlen(s) + 1);
+	if (p) {
+		pool_put(p, s);
+	} else {
+		free(s);
+	}
+}
+
+int pool_get_stats(struct pool_stats *stats, int max) {
+	pthread_mutex_lock(&pools_lock);
+	int n = pool_count < max ? pool_count : max;
+	for (int i = 0; i < n; i++) {
+		struct pool *p = pools[i];
+		stats[i].name = p->name;
+		stats[i].object_size = p->size;
+		stats[i].in_use = __atomic_load_n(&p->in_use, __ATOMIC_RELAXED);
+		stats[i].allocs = __atomic_load_n(&p->allocs, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&p->lock);
+		stats[i].slabs = p->slabs;
+		stats[i].bytes = p->slabs * p->slab_size;
+		pthread_mutex_unlock(&p->lock);
+	}
+	pthread_mutex_unlock(&pools_lock);
+	return n;
+}
@@ -0,0 +1,58 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Fixed-size object pools.
+//
+// Each pool hands out objects of one size, carved from large slabs that are
+// never returned to the system. Freed objects go to a small cache owned by
+// the freeing thread and are handed out again by that thread without taking
+// a lock; only when a cache runs empty or overflows does it trade a batch of
+// objects with the pool's shared free list.
+
+#define POOL_MAX 16
+
+struct pool {
+	const char *name;
+	size_t size;
+	int id;
+	pthread_mutex_t lock;
+	// shared free list, linked through the first word of each object
+	void *free;
+	size_t free_count;
+	// unused tail of the newest slab
+	char *bump;
+	char *bump_end;
+	size_t slabs;
+	size_t slab_size;
+	// objects handed out and not yet returned
+	size_t in_use;
+	uint64_t allocs;
+};
+
+struct pool_stats {
+	const char *name;
+	size_t object_size;
+	size_t in_use;
+	size_t slabs;
+	size_t bytes;		// slab memory taken from the system
+	uint64_t allocs;
+};
+
+void pool_init(struct pool *p, const char *name, size_t size);
+void *pool_get(struct pool *p);
+void pool_put(struct pool *p, void *obj);
+
+// Strings up to 256 bytes come from size-class pools, longer ones from malloc.
+// The class is found from the length, so a pooled string must not be shortened.
+char *pool_strdup(const char *s);
+char *pool_strndup(const char *s, size_t n);
+void pool_free_str(char *s);
+
+// Fill stats with one record per pool, returns the number of pools.
+int pool_get_stats(struct pool_stats *stats, int max);
+
+#endif
@@ -0,0 +1,406 @@
+// fallocate, copy_file_range
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "core.h"
+#include "optrace.h"
+#include "stats.h"
+
+// Replay an op trace recorded with -o op_trace=PATH.
+//
+//     ./replay [-m mountpoint | -e [-i image]] [-s speed] trace
+//
+// With -m the ops are done with system calls on the paths under the mount
+// point; with -e (the default) they go straight to the filesystem core in
+// this process, starting from an empty tree or the image given with -i.
+// A speed of 1 keeps the gaps between ops as recorded, 10 replays ten times
+// faster and 0 (the default) as fast as possible. Ops run one at a time in
+// the order they started.
+//
+// At the end it prints how many ops were replayed, skipped and gave a
+// different error than in the trace, followed by the latency table of the
+// replayed ops.
+
+struct op {
+	struct optrace_record rec;
+	char *path;
+};
+
+// Files opened by the trace that are not released yet.
+struct handle {
+	char *path;
+	int fd;
+	struct fuse_file_info fi;
+};
+
+static struct op *ops;
+static size_t nops;
+static struct handle *handles;
+static int nhandles;
+static int handles_cap;
+static char *buf;
+static size_t buf_size;
+
+static const char *mountpoint;
+static double speed;
+
+static void load_trace(const char *path) {
+	struct optrace_header header;
+	size_t cap = 0;
+
+	FILE *in = fopen(path, "rb");
+	if (in == NULL) {
+		perror(path);
+		exit(1);
+	}
+	if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != OPTRACE_MAGIC ||
+			header.version != OPTRACE_VERSION || header.record_size != sizeof(struct optrace_record)) {
+		fprintf(stderr, "%s: not an op trace of this version\n", path);
+		exit(1);
+	}
+	for (;;) {
+		if (nops == cap) {
+			cap = cap ? cap * 2 : 4096;
+			ops = realloc(ops, cap * sizeof(struct op));
+			if (ops == NULL) {
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+		}
+		struct op *op = &ops[nops];
+		if (fread(&op->rec, sizeof(op->rec), 1, in) != 1) {
+			break;
+		}
+		op->path = calloc(1, op->rec.path_len + 1);
+		if (op->path == NULL || fread(op->path, 1, op->rec.path_len, in) != op->rec.path_len) {
+			fprintf(stderr, "%s: truncated at record %zu\n", path, nops);
+			break;
+		}
+		nops++;
+	}
+	fclose(in);
+}
+
+static int compare_start(const void *a, const void *b) {
+	uint64_t x = ((const struct op *) a)->rec.start_ns, y = ((const struct op *) b)->rec.start_ns;
+	return x < y ? -1 : x > y;
+}
+
+static char *data(size_t size) {
+	if (size > buf_size) {
+		buf = realloc(buf, size);
+		if (buf == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		memset(buf, 'r', size);
+		buf_size = size;
+	}
+	return buf;
+}
+
+static struct handle *open_handle(const char *path, const char *full, int flags) {
+	if (nhandles == handles_cap) {
+		handles_cap = handles_cap ? handles_cap * 2 : 64;
+		handles = realloc(handles, handles_cap * sizeof(struct handle));
+	}
+	struct handle *h = &handles[nhandles];
+	memset(h, 0, sizeof(struct handle));
+	h->fi.flags = flags;
+	if (mountpoint) {
+		h->fd = open(full, flags);
+		if (h->fd < 0) {
+			return NULL;
+		}
+	} else if (lfs_open(path, &h->fi) != 0) {
+		return NULL;
+	}
+	h->path = strdup(path);
+	nhandles++;
+	return h;
+}
+
+//The newest handle open on path, opened now if the trace started after
+//the file was opened.
+static struct handle *find_handle(const char *path, const char *full, int flags) {
+	for (int i = nhandles - 1; i >= 0; i--) {
+		if (strcmp(handles[i].path, path) == 0) {
+			return &handles[i];
+		}
+	}
+	return open_handle(path, full, flags);
+}
+
+static int close_handle(const char *path) {
+	for (int i = nhandles - 1; i >= 0; i--) {
+		if (strcmp(handles[i].path, path) == 0) {
+			int res = mountpoint ? close(handles[i].fd) : lfs_release(path, &handles[i].fi);
+			free(handles[i].path);
+			handles[i] = handles[--nhandles];
+			return res;
+		}
+	}
+	return 0;
+}
+
+//The destination of a copy_file_range, which follows the source in path.
+static const char *out_path(struct optrace_record *rec, const char *path) {
+	size_t len = strlen(path);
+	return len < rec->path_len ? path + len + 1 : "";
+}
+
+static int64_t syscall_result(long res) {
+	return res < 0 ? -errno : res;
+}
+
+static int count_names(void *b, const char *name, const struct stat *st, off_t off, enum fuse_fill_dir_flags flags) {
+	return 0;
+}
+
+static int64_t replay_engine(struct optrace_record *rec, const char *path) {
+	struct stat st;
+	struct statvfs sv;
+	struct handle *h;
+
+	switch (rec->op) {
+	case STAT_GETATTR:
+		return lfs_getattr(path, &st, NULL);
+	case STAT_READDIR:
+		return lfs_readdir(path, NULL, count_names, rec->offset, NULL, FUSE_READDIR_PLUS);
+	case STAT_MKNOD:
+		return lfs_mknod(path, rec->size, 0);
+	case STAT_MKDIR:
+		return lfs_mkdir(path, rec->size);
+	case STAT_UNLINK:
+		return lfs_unlink(path);
+	case STAT_RMDIR:
+		return lfs_rmdir(path);
+	case STAT_TRUNCATE:
+		return lfs_truncate(path, rec->size, NULL);
+	case STAT_OPEN:
+		h = open_handle(path, NULL, rec->size);
+		return h ? 0 : -ENOENT;
+	case STAT_READ:
+		h = find_handle(path, NULL, O_RDONLY);
+		return h ? lfs_read(path, data(rec->size), rec->size, rec->offset, &h->fi) : -ENOENT;
+	case STAT_WRITE:
+		h = find_handle(path, NULL, O_WRONLY);
+		return h ? lfs_write(path, data(rec->size), rec->size, rec->offset, &h->fi) : -ENOENT;
+	case STAT_FLUSH:
+		h = find_handle(path, NULL, O_WRONLY);
+		return h ? lfs_flush(path, &h->fi) : -ENOENT;
+	case STAT_FSYNC:
+		h = find_handle(path, NULL, O_WRONLY);
+		return h ? lfs_fsync(path, rec->size, &h->fi) : -ENOENT;
+	case STAT_RELEASE:
+		return close_handle(path);
+	case STAT_LSEEK:
+		h = find_handle(path, NULL, O_RDONLY);
+		return h ? lfs_lseek(path, rec->offset, rec->size, &h->fi) : -ENOENT;
+	case STAT_FALLOCATE:
+		h = find_handle(path, NULL, O_WRONLY);
+		return h ? lfs_fallocate(path, rec->mode, rec->offset, rec->size, &h->fi) : -ENOENT;
+	case STAT_COPY_FILE_RANGE: {
+		//Opening the destination can move the source handle.
+		h = find_handle(path, NULL, O_RDONLY);
+		if (h == NULL) {
+			return -ENOENT;
+		}
+		struct fuse_file_info fi_in = h->fi;
+		const char *out = out_path(rec, path);
+		h = find_handle(out, NULL, O_WRONLY);
+		return h ? lfs_copy_file_range(path, &fi_in, rec->offset, out, &h->fi, rec->out_offset, rec->size, 0) : -ENOENT;
+	}
+	case STAT_UTIMENS: {
+		struct timespec tv[2] = { { .tv_sec = rec->offset }, { .tv_sec = rec->size } };
+		return lfs_utimens(path, tv, NULL);
+	}
+	case STAT_STATFS:
+		return lfs_statfs(path, &sv);
+	}
+	return -ENOSYS;
+}
+
+static int64_t replay_mount(struct optrace_record *rec, const char *path, const char *full) {
+	struct stat st;
+	struct statvfs sv;
+	struct handle *h;
+	DIR *dir;
+
+	switch (rec->op) {
+	case STAT_GETATTR:
+		return syscall_result(lstat(full, &st));
+	case STAT_READDIR:
+		//The kernel asks for a listing in pieces, a whole one is done at
+		//the first piece.
+		if (rec->offset != 0) {
+			return rec->result;
+		}
+		dir = opendir(full);
+		if (dir == NULL) {
+			return -errno;
+		}
+		while (readdir(dir) != NULL) {
+		}
+		closedir(dir);
+		return 0;
+	case STAT_MKNOD:
+		return syscall_result(mknod(full, rec->size, 0));
+	case STAT_MKDIR:
+		return syscall_result(mkdir(full, rec->size & 07777));
+	case STAT_UNLINK:
+		return syscall_result(unlink(full));
+	case STAT_RMDIR:
+		return syscall_result(rmdir(full));
+	case STAT_TRUNCATE:
+		return syscall_result(truncate(full, rec->size));
+	case STAT_OPEN:
+		h = open_handle(path, full, rec->size & (O_ACCMODE | O_APPEND));
+		return h ? 0 : -errno;
+	case STAT_READ:
+		h = find_handle(path, full, O_RDONLY);
+		return h ? syscall_result(pread(h->fd, data(rec->size), rec->size, rec->offset)) : -errno;
+	case STAT_WRITE:
+		h = find_handle(path, full, O_WRONLY);
+		return h ? syscall_result(pwrite(h->fd, data(rec->size), rec->size, rec->offset)) : -errno;
+	case STAT_FLUSH:
+		//The kernel flushes on every close, also of a duplicate.
+		h = find_handle(path, full, O_WRONLY);
+		return h ? syscall_result(close(dup(h->fd))) : -errno;
+	case STAT_FSYNC:
+		h = find_handle(path, full, O_WRONLY);
+		return h ? syscall_result(rec->size ? fdatasync(h->fd) : fsync(h->fd)) : -errno;
+	case STAT_RELEASE:
+		return close_handle(path);
+	case STAT_LSEEK:
+		h = find_handle(path, full, O_RDONLY);
+		return h ? syscall_result(lseek(h->fd, rec->offset, rec->size)) : -errno;
+	case STAT_FALLOCATE:
+		h = find_handle(path, full, O_WRONLY);
+		return h ? syscall_result(fallocate(h->fd, rec->mode, rec->offset, rec->size)) : -errno;
+	case STAT_COPY_FILE_RANGE: {
+		h = find_handle(path, full, O_RDONLY);
+		if (h == NULL) {
+			return -errno;
+		}
+		int fd_in = h->fd;
+		char full_out[PATH_MAX];
+		snprintf(full_out, sizeof(full_out), "%s%s", mountpoint, out_path(rec, path));
+		h = find_handle(out_path(rec, path), full_out, O_WRONLY);
+		if (h == NULL) {
+			return -errno;
+		}
+		loff_t offset_in = rec->offset, offset_out = rec->out_offset;
+		return syscall_result(copy_file_range(fd_in, &offset_in, h->fd, &offset_out, rec->size, 0));
+	}
+	case STAT_UTIMENS: {
+		struct timespec tv[2] = { { .tv_sec = rec->offset }, { .tv_sec = rec->size } };
+		return syscall_result(utimensat(AT_FDCWD, full, tv, AT_SYMLINK_NOFOLLOW));
+	}
+	case STAT_STATFS:
+		return syscall_result(statvfs(mountpoint, &sv));
+	}
+	return -ENOSYS;
+}
+
+static void sleep_until(uint64_t when) {
+	uint64_t now = stats_now();
+	if (when > now) {
+		struct timespec ts = { (when - now) / 1000000000, (when - now) % 1000000000 };
+		nanosleep(&ts, NULL);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	const char *image = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:ei:s:")) != -1) {
+		switch (opt) {
+		case 'm':
+			mountpoint = optarg;
+			break;
+		case 'e':
+			mountpoint = NULL;
+			break;
+		case 'i':
+			image = optarg;
+			break;
+		case 's':
+			speed = atof(optarg);
+			break;
+		default:
+			optind = argc;
+			break;
+		}
+	}
+	if (optind != argc - 1 || speed < 0) {
+		fprintf(stderr, "usage: %s [-m mountpoint | -e [-i image]] [-s speed] trace\n", argv[0]);
+		return 1;
+	}
+
+	load_trace(argv[optind]);
+	qsort(ops, nops, sizeof(struct op), compare_start);
+
+	if (mountpoint == NULL) {
+		if (core_init() != 0) {
+			fprintf(stderr, "could not set up the filesystem\n");
+			return 1;
+		}
+		if (image) {
+			FILE *fp = fopen(image, "rb");
+			if (fp == NULL || read_entries_from_file(fp) != 0) {
+				fprintf(stderr, "could not load %s\n", image);
+				return 1;
+			}
+		}
+	}
+
+	size_t replayed = 0, skipped = 0, mismatched = 0;
+	char full[PATH_MAX];
+	uint64_t begin = stats_now();
+	for (size_t i = 0; i < nops; i++) {
+		struct optrace_record *rec = &ops[i].rec;
+		const char *path = ops[i].path;
+
+		//Control files and image loads and saves are not part of the workload.
+		if (rec->op == STAT_IMAGE_LOAD || rec->op == STAT_IMAGE_SAVE || rec->op >= STAT_OPS ||
+				strncmp(path, "/.lfs", 5) == 0) {
+			skipped++;
+			continue;
+		}
+		if (speed > 0) {
+			sleep_until(begin + rec->start_ns / speed);
+		}
+		snprintf(full, sizeof(full), "%s%s", mountpoint ? mountpoint : "", path);
+
+		uint64_t start = stats_now();
+		int64_t res = mountpoint ? replay_mount(rec, path, full) : replay_engine(rec, path);
+		stats_record(rec->op, start, res);
+		replayed++;
+		if ((res < 0) != (rec->result < 0) || (res < 0 && res != rec->result)) {
+			mismatched++;
+		}
+	}
+	double secs = (stats_now() - begin) / 1e9;
+	double traced = nops ? (ops[nops - 1].rec.start_ns - ops[0].rec.start_ns) / 1e9 : 0;
+
+	printf("# replay ops=%zu skipped=%zu mismatched=%zu seconds=%.3f traced_seconds=%.3f\n",
+		replayed, skipped, mismatched, secs, traced);
+	char table[16384];
+	stats_format(table, sizeof(table));
+	fputs(table, stdout);
+	return 0;
+}
@@ -0,0 +1,189 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+#include "threadslot.h"
+
+// Log-linear buckets: values below 16 ns get a bucket each, above that
+// every power of two is split in 16, so a bucket is within 6% of its values.
+#define SUB_BITS 4
+#define SUB (1 << SUB_BITS)
+#define BUCKETS ((64 - SUB_BITS + 1) * SUB)
+
+struct op_stats {
+	uint64_t count;
+	uint64_t errors;
+	uint64_t bytes;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t hist[BUCKETS];
+};
+
+struct stats_block {
+	struct thread_slot slot;
+	struct op_stats ops[STAT_OPS];
+};
+
+static const char *op_names[STAT_OPS] = {
+	"getattr", "readdir", "mknod", "mkdir", "unlink", "rmdir", "truncate",
+	"open", "read", "release", "write", "utimens", "statfs",
+	"image_load", "image_save", "lseek", "compress", "decompress",
+	"fallocate", "copy_file_range", "flush", "fsync",
+};
+
+// A thread that starts recording takes over the block of one that exited
+// and adds to its counts, so the totals still include the exited thread.
+static struct thread_slots blocks = THREAD_SLOTS_INIT(struct stats_block);
+static __thread void *my_block;
+
+const char *stats_op_name(enum stat_op op) {
+	return op < STAT_OPS ? op_names[op] : "unknown";
+}
+
+uint64_t stats_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bucket(uint64_t ns) {
+	if (ns < SUB) {
+		return ns;
+	}
+	int e = 63 - __builtin_clzll(ns);
+	return (e - SUB_BITS + 1) * SUB + ((ns >> (e - SUB_BITS)) & (SUB - 1));
+}
+
+//Middle of the values that fall in bucket i.
+static uint64_t bucket_value(int i) {
+	if (i < SUB) {
+		return i;
+	}
+	int e = i / SUB + SUB_BITS - 1;
+	uint64_t low = (uint64_t) (SUB + i % SUB) << (e - SUB_BITS);
+	return low + ((1ULL << (e - SUB_BITS)) >> 1);
+}
+
+//Only the owning thread writes a block; the store is atomic so readers
+//never see a torn value.
+static inline void add(uint64_t *p, uint64_t v) {
+	__atomic_store_n(p, *p + v, __ATOMIC_RELAXED);
+}
+
+void stats_record(enum stat_op op, uint64_t start, int64_t result) {
+	struct stats_block *b = my_block;
+	if (b == NULL) {
+		b = thread_slot_get(&blocks, &my_block);
+		if (b == NULL) {
+			return;
+		}
+	}
+	uint64_t ns = stats_now() - start;
+	struct op_stats *s = &b->ops[op];
+	add(&s->count, 1);
+	add(&s->sum_ns, ns);
+	add(&s->hist[bucket(ns)], 1);
+	if (result < 0) {
+		add(&s->errors, 1);
+	} else if (op != STAT_LSEEK) {
+		add(&s->bytes, result);
+	}
+	if (ns > s->max_ns) {
+		__atomic_store_n(&s->max_ns, ns, __ATOMIC_RELAXED);
+	}
+}
+
+//Sum op over all threads.
+static void merge(enum stat_op op, struct op_stats *out) {
+	memset(out, 0, sizeof(struct op_stats));
+	for (struct thread_slot *slot = thread_slot_first(&blocks); slot; slot = slot->next) {
+		struct stats_block *b = (struct stats_block *) slot;
+		struct op_stats *s = &b->ops[op];
+		out->count += __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+		out->errors += __atomic_load_n(&s->errors, __ATOMIC_RELAXED);
+		out->bytes += __atomic_load_n(&s->bytes, __ATOMIC_RELAXED);
+		out->sum_ns += __atomic_load_n(&s->sum_ns, __ATOMIC_RELAXED);
+		uint64_t max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+		if (max > out->max_ns) {
+			out->max_ns = max;
+		}
+		for (int i = 0; i < BUCKETS; i++) {
+			out->hist[i] += __atomic_load_n(&s->hist[i], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+//Latency below which a fraction q of the ops finished.
+static uint64_t percentile(struct op_stats *s, double q) {
+	uint64_t total = 0;
+	for (int i = 0; i < BUCKETS; i++) {
+		total += s->hist[i];
+	}
+	if (total == 0) {
+		return 0;
+	}
+	//Rank of the op we want, rounded up.
+	uint64_t want = q * total, seen = 0;
+	if (want < q * total || want == 0) {
+		want++;
+	}
+	for (int i = 0; i < BUCKETS; i++) {
+		seen += s->hist[i];
+		if (seen >= want) {
+			uint64_t v = bucket_value(i);
+			return v < s->max_ns ? v : s->max_ns;
+		}
+	}
+	return s->max_ns;
+}
+
+static size_t append(char *buf, size_t size, size_t len, const char *fmt, ...) {
+	va_list ap;
+	if (len >= size) {
+		return len;
+	}
+	va_start(ap, fmt);
+	int n = vsnprintf(buf + len, size - len, fmt, ap);
+	va_end(ap);
+	len += n > 0 ? n : 0;
+	return len < size ? len : size - 1;
+}
+
+size_t stats_format(char *buf, size_t size) {
+	struct op_stats s;
+	size_t len = 0;
+
+	len = append(buf, size, len, "%-15s %10s %8s %14s %10s %10s %10s %10s %10s %10s\n",
+		"op", "count", "errors", "bytes", "mean_us", "p50_us", "p90_us", "p99_us", "p999_us", "max_us");
+	for (int op = 0; op < STAT_OPS; op++) {
+		merge(op, &s);
+		len = append(buf, size, len, "%-15s %10llu %8llu %14llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+			op_names[op], (unsigned long long) s.count, (unsigned long long) s.errors,
+			(unsigned long long) s.bytes, s.count ? s.sum_ns / 1000.0 / s.count : 0.0,
+			percentile(&s, 0.5) / 1000.0, percentile(&s, 0.9) / 1000.0,
+			percentile(&s, 0.99) / 1000.0, percentile(&s, 0.999) / 1000.0, s.max_ns / 1000.0);
+	}
+	return len;
+}
+
+size_t stats_format_json(char *buf, size_t size) {
+	struct op_stats s;
+	size_t len = 0;
+
+	len = append(buf, size, len, "{");
+	for (int op = 0; op < STAT_OPS; op++) {
+		merge(op, &s);
+		len = append(buf, size, len, "%s\n\"%s\":{\"count\":%llu,\"errors\":%llu,\"bytes\":%llu,"
+			"\"sum_ns\":%llu,\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}",
+			op ? "," : "", op_names[op], (unsigned long long) s.count, (unsigned long long) s.errors,
+			(unsigned long long) s.bytes, (unsigned long long) s.sum_ns,
+			(unsigned long long) percentile(&s, 0.5), (unsigned long long) percentile(&s, 0.9),
+			(unsigned long long) percentile(&s, 0.99), (unsigned long long) percentile(&s, 0.999),
+			(unsigned long long) s.max_ns);
+	}
+	len = append(buf, size, len, "\n}\n");
+	return len;
+}
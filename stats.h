@@ -0,0 +1,54 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Per-operation counters and latency histograms.
+//
+// Each thread records into its own block with plain stores, so recording
+// costs a clock read and a few increments on memory no other thread writes.
+// Blocks are only summed when somebody reads the stats.
+
+// Op traces store these numbers, so new ops go at the end.
+enum stat_op {
+	STAT_GETATTR,
+	STAT_READDIR,
+	STAT_MKNOD,
+	STAT_MKDIR,
+	STAT_UNLINK,
+	STAT_RMDIR,
+	STAT_TRUNCATE,
+	STAT_OPEN,
+	STAT_READ,
+	STAT_RELEASE,
+	STAT_WRITE,
+	STAT_UTIMENS,
+	STAT_STATFS,
+	STAT_IMAGE_LOAD,
+	STAT_IMAGE_SAVE,
+	STAT_LSEEK,
+	STAT_COMPRESS,
+	STAT_DECOMPRESS,
+	STAT_FALLOCATE,
+	STAT_COPY_FILE_RANGE,
+	STAT_FLUSH,
+	STAT_FSYNC,
+	STAT_OPS
+};
+
+// Monotonic clock in nanoseconds.
+uint64_t stats_now(void);
+
+// Count one op that started at start. A negative result is counted as an
+// error, a positive one as bytes moved, except for lseek where it is an
+// offset.
+void stats_record(enum stat_op op, uint64_t start, int64_t result);
+
+const char *stats_op_name(enum stat_op op);
+
+// Print all ops as a text table or as JSON. Returns the length written.
+size_t stats_format(char *buf, size_t size);
+size_t stats_format_json(char *buf, size_t size);
+
+#endif
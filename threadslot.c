@@ -0,0 +1,54 @@
+#include <stdlib.h>
+
+#include "threadslot.h"
+
+static pthread_mutex_t key_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Runs when a thread that has a slot exits.
+static void release_slot(void *arg) {
+	struct thread_slot *slot = arg;
+	*slot->owner = NULL;
+	__atomic_store_n(&slot->unused, true, __ATOMIC_RELEASE);
+}
+
+static void make_key(struct thread_slots *slots) {
+	pthread_mutex_lock(&key_lock);
+	if (!slots->key_made) {
+		pthread_key_create(&slots->key, release_slot);
+		__atomic_store_n(&slots->key_made, true, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&key_lock);
+}
+
+void *thread_slot_get(struct thread_slots *slots, void **mine) {
+	if (!__atomic_load_n(&slots->key_made, __ATOMIC_ACQUIRE)) {
+		make_key(slots);
+	}
+	struct thread_slot *slot;
+	for (slot = thread_slot_first(slots); slot; slot = slot->next) {
+		bool unused = true;
+		if (__atomic_load_n(&slot->unused, __ATOMIC_RELAXED) &&
+				__atomic_compare_exchange_n(&slot->unused, &unused, false, false,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+	if (slot == NULL) {
+		slot = calloc(1, slots->size);
+		if (slot == NULL) {
+			return NULL;
+		}
+		slot->next = __atomic_load_n(&slots->head, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&slots->head, &slot->next, slot, false,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		}
+	}
+	slot->owner = mine;
+	*mine = slot;
+	pthread_setspecific(slots->key, slot);
+	return slot;
+}
+
+struct thread_slot *thread_slot_first(struct thread_slots *slots) {
+	return __atomic_load_n(&slots->head, __ATOMIC_ACQUIRE);
+}
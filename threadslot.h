@@ -0,0 +1,41 @@
+#ifndef THREADSLOT_H
+#define THREADSLOT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Memory of its own for each thread, written only by that thread and read
+// by any, as the log rings and the stats blocks are.
+//
+// A slot is a struct that starts with a struct thread_slot. Slots are never
+// freed, since readers walk the list without a lock. When a thread exits
+// its slot is marked unused, and the next thread that asks for one takes it
+// over with what is in it. So there are only as many slots as threads that
+// ever ran at the same time.
+
+struct thread_slot {
+	struct thread_slot *next;
+	bool unused;
+	// the owning thread's pointer to the slot, cleared when it exits
+	void **owner;
+};
+
+struct thread_slots {
+	size_t size;
+	struct thread_slot *head;
+	pthread_key_t key;
+	bool key_made;
+};
+
+#define THREAD_SLOTS_INIT(type) { .size = sizeof(type) }
+
+// Point *mine, a __thread variable of the caller, at a slot for the calling
+// thread: an unused one or a new zeroed one. Returns the slot, NULL if out
+// of memory.
+void *thread_slot_get(struct thread_slots *slots, void **mine);
+
+// First slot, the others follow through next.
+struct thread_slot *thread_slot_first(struct thread_slots *slots);
+
+#endif